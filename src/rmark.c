@@ -1,6 +1,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <cmark.h>
 
@@ -12,6 +28,10 @@
 // Initialised on package load.
 SEXP rmark_root_symbol;
 SEXP rmark_node_symbol;
+SEXP rmark_registry_symbol;
+SEXP rmark_parser_symbol;
+SEXP rmark_iter_symbol;
+SEXP rmark_session_symbol;
 
 #define HAS_RMARK_TAG(x) \
     (R_ExternalPtrTag(x) == rmark_node_symbol || R_ExternalPtrTag(x) == rmark_root_symbol)
@@ -30,7 +50,7 @@ SEXP rmark_r_node_new(SEXP node) {
 }
 
 #define PTR(x) rmark_r_node_get_ptr(x)
-#define NODE(x) ((cmark_node *)R_ExternalPtrAddr(PTR(x)))
+#define NODE(x) rmark_r_node_get_node(x)
 #define ROOT(x) rmark_node_get_root(PTR(x))
 
 SEXP rmark_r_node_get_ptr(SEXP x) {
@@ -41,6 +61,15 @@ SEXP rmark_r_node_get_ptr(SEXP x) {
     return node;
 }
 
+// Nodes merged away by md_consolidate() have their pointers cleared.
+cmark_node *rmark_r_node_get_node(SEXP x) {
+    cmark_node *node = R_ExternalPtrAddr(PTR(x));
+    if (!node) {
+        Rf_error("`x` is no longer a valid Markdown node.");
+    }
+    return node;
+}
+
 SEXP rmark_node_get_root(SEXP x) {
     SEXP tag = R_ExternalPtrTag(x);
     if (tag == rmark_root_symbol) {
@@ -61,45 +90,921 @@ void rmark_finalize_node_ptr(SEXP x) {
     }
 }
 
+/** Source Positions */
+
+// cmark can't set source positions, so copies of parsed nodes, made by
+// md_clone(), the parse cache and md_unserialize(), keep theirs in a table
+// keyed by the node instead. rmark_node_position() reads positions through
+// it. Entries are dropped when their node is free'd, before the address can
+// be reused. Only the main thread adds entries; workers free nodes of their
+// own documents, which never have one, so they only ever look up the table.
+
+typedef struct {
+    int start_line;
+    int start_column;
+    int end_line;
+    int end_column;
+} rmark_position;
+
+typedef struct rmark_position_entry {
+    cmark_node *node;
+    rmark_position position;
+    struct rmark_position_entry *next; // Next entry in the same bucket.
+} rmark_position_entry;
+
+typedef struct {
+    rmark_position_entry **buckets;
+    int capacity; // Always a power of two, or zero before the first entry.
+    int count;
+} rmark_position_table;
+
+rmark_position_table rmark_positions = { NULL, 0, 0 };
+
+#define RMARK_POSITION_TABLE_MIN_CAPACITY 64
+
+// Hash a node pointer into a table of `capacity` slots, a power of two.
+int rmark_node_hash(cmark_node *node, int capacity) {
+    size_t hash = (size_t)(uintptr_t) node >> 4; // Low bits are zero due to alignment.
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return (int)(hash & (size_t)(capacity - 1));
+}
+
+rmark_position_entry *rmark_position_find(cmark_node *node) {
+    if (rmark_positions.count == 0)
+        return NULL;
+    rmark_position_entry *entry = rmark_positions.buckets[rmark_node_hash(node, rmark_positions.capacity)];
+    for (; entry; entry = entry->next) {
+        if (entry->node == node)
+            return entry;
+    }
+    return NULL;
+}
+
+// Called for every allocation free'd while the table has entries.
+void rmark_position_drop(void *ptr) {
+    cmark_node *node = ptr;
+    rmark_position_entry **link = &rmark_positions.buckets[rmark_node_hash(node, rmark_positions.capacity)];
+    while (*link) {
+        rmark_position_entry *entry = *link;
+        if (entry->node == node) {
+            *link = entry->next;
+            R_Free(entry);
+            rmark_positions.count--;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+// Give a node made through the cmark API a source position. Nodes without a
+// position don't need an entry.
+void rmark_position_set(cmark_node *node, rmark_position position) {
+    rmark_position_entry *entry = rmark_position_find(node);
+    if (entry) {
+        entry->position = position;
+        return;
+    }
+    if (position.start_line <= 0 && position.end_line <= 0)
+        return;
+
+    rmark_position_table *table = &rmark_positions;
+    if (table->count >= table->capacity) {
+        int capacity = table->capacity ? 2 * table->capacity : RMARK_POSITION_TABLE_MIN_CAPACITY;
+        rmark_position_entry **buckets = R_Calloc(capacity, rmark_position_entry *);
+        for (int i = 0; i < table->capacity; i++) {
+            rmark_position_entry *old = table->buckets[i];
+            while (old) {
+                rmark_position_entry *next = old->next;
+                int j = rmark_node_hash(old->node, capacity);
+                old->next = buckets[j];
+                buckets[j] = old;
+                old = next;
+            }
+        }
+        R_Free(table->buckets);
+        table->buckets = buckets;
+        table->capacity = capacity;
+    }
+
+    entry = R_Calloc(1, rmark_position_entry);
+    int i = rmark_node_hash(node, table->capacity);
+    *entry = (rmark_position_entry) { node, position, table->buckets[i] };
+    table->buckets[i] = entry;
+    table->count++;
+}
+
+// The source position of a node, without the line offsets of its tree.
+rmark_position rmark_node_position(cmark_node *node) {
+    rmark_position_entry *entry = rmark_position_find(node);
+    if (entry)
+        return entry->position;
+    return (rmark_position) {
+        cmark_node_get_start_line(node), cmark_node_get_start_column(node),
+        cmark_node_get_end_line(node), cmark_node_get_end_column(node)
+    };
+}
+
+/** Allocation and Statistics */
+
+// All cmark memory goes through our allocator, so that we can report how much
+// of it is live and optionally carve documents out of arenas. Allocations
+// start with a header recording their size and arena, so memory handed out
+// by cmark must be free'd with rmark_mem_free(). Counters are updated
+// atomically since workers parse and render in parallel.
+
+typedef struct {
+    double parse_calls;
+    double parse_seconds;
+    double render_calls;
+    double render_seconds;
+    double cmark_allocations;
+    size_t cmark_bytes;
+    size_t cmark_peak_bytes;
+} rmark_stats;
+
+rmark_stats rmark_process_stats = {0};
+
+void rmark_stats_alloc(size_t added, size_t removed) {
+    size_t bytes;
+#ifdef _OPENMP
+    #pragma omp atomic capture
+#endif
+    bytes = rmark_process_stats.cmark_bytes += added - removed;
+#ifdef _OPENMP
+    #pragma omp atomic
+#endif
+    rmark_process_stats.cmark_allocations += (added > 0);
+    // The peak is only written in the critical section, but read outside it
+    // to skip the section in the common case, so both sides are atomic.
+    size_t peak;
+#ifdef _OPENMP
+    #pragma omp atomic read
+#endif
+    peak = rmark_process_stats.cmark_peak_bytes;
+    if (bytes > peak && bytes < SIZE_MAX / 2) {
+#ifdef _OPENMP
+        #pragma omp critical (rmark_stats_peak)
+#endif
+        if (bytes > rmark_process_stats.cmark_peak_bytes) {
+#ifdef _OPENMP
+            #pragma omp atomic write
+#endif
+            rmark_process_stats.cmark_peak_bytes = bytes;
+        }
+    }
+}
+
+// Arenas hand out memory from a few large blocks, so that parsing a document
+// doesn't call malloc() for every node and string. Freeing arena memory only
+// decrements a count of live allocations; once the parse is done (sealed) and
+// the count drops to zero, all blocks are released at once.
+//
+// Nodes can move to other trees, so an arena lives for as long as any of its
+// allocations do, wherever they ended up. Allocations made outside a parse,
+// such as by setters, use malloc() even for nodes that live in an arena.
+
+typedef struct rmark_arena_block {
+    struct rmark_arena_block *next;
+    size_t size;
+    size_t used;
+} rmark_arena_block;
+
+typedef struct {
+    rmark_arena_block *blocks; // The current block first.
+    void *last; // Most recent allocation, which can grow or shrink in place.
+    size_t live;
+    bool sealed;
+} rmark_arena;
+
+typedef struct {
+    rmark_arena *arena; // NULL for allocations from malloc().
+    size_t size;
+} rmark_alloc_header;
+
+#define RMARK_ARENA_BLOCK_SIZE (64 * 1024)
+#define RMARK_ALIGN(n) (((n) + sizeof(rmark_alloc_header) - 1) & ~(sizeof(rmark_alloc_header) - 1))
+#define RMARK_BLOCK_DATA(block) ((char *)(block) + RMARK_ALIGN(sizeof(rmark_arena_block)))
+#define RMARK_HEADER(ptr) ((rmark_alloc_header *)(ptr) - 1)
+
+// The arena that allocations on this thread currently go to, if any.
+_Thread_local rmark_arena *rmark_current_arena = NULL;
+
+void rmark_arena_release(rmark_arena *arena) {
+    rmark_arena_block *block = arena->blocks;
+    while (block) {
+        rmark_arena_block *next = block->next;
+        rmark_stats_alloc(0, block->size);
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+// Allocate uninitialised memory from an arena, or NULL if out of memory.
+void *rmark_arena_alloc(rmark_arena *arena, size_t size) {
+    size_t needed = sizeof(rmark_alloc_header) + RMARK_ALIGN(size);
+    rmark_arena_block *block = arena->blocks;
+    if (!block || block->size - block->used < needed) {
+        size_t block_size = RMARK_ALIGN(sizeof(rmark_arena_block)) + needed;
+        if (block_size < RMARK_ARENA_BLOCK_SIZE)
+            block_size = RMARK_ARENA_BLOCK_SIZE;
+        block = malloc(block_size);
+        if (!block)
+            return NULL;
+        block->size = block_size;
+        block->used = RMARK_ALIGN(sizeof(rmark_arena_block));
+        block->next = arena->blocks;
+        arena->blocks = block;
+        rmark_stats_alloc(block_size, 0);
+    }
+    rmark_alloc_header *header = (rmark_alloc_header *)((char *) block + block->used);
+    block->used += needed;
+    header->arena = arena;
+    header->size = size;
+    arena->live++;
+    arena->last = header + 1;
+    return header + 1;
+}
+
+// Try to resize the most recent allocation of an arena without moving it.
+bool rmark_arena_resize(rmark_arena *arena, void *ptr, size_t size) {
+    rmark_arena_block *block = arena->blocks;
+    if (ptr != arena->last || !block)
+        return false;
+    size_t start = (char *) ptr - (char *) block;
+    if (block->size - start < RMARK_ALIGN(size))
+        return false;
+    block->used = start + RMARK_ALIGN(size);
+    RMARK_HEADER(ptr)->size = size;
+    return true;
+}
+
+void rmark_arena_free(rmark_arena *arena, void *ptr) {
+    if (ptr == arena->last) {
+        arena->blocks->used = (char *) RMARK_HEADER(ptr) - (char *) arena->blocks;
+        arena->last = NULL;
+    }
+    if (--arena->live == 0 && arena->sealed)
+        rmark_arena_release(arena);
+}
+
+rmark_arena *rmark_arena_new(void) {
+    return calloc(1, sizeof(rmark_arena));
+}
+
+// Stop allocating from an arena. It's released once all its memory is free'd.
+void rmark_arena_seal(rmark_arena *arena) {
+    if (rmark_current_arena == arena)
+        rmark_current_arena = NULL;
+    arena->sealed = true;
+    if (arena->live == 0)
+        rmark_arena_release(arena);
+}
+
+void *rmark_malloc_alloc(size_t size) {
+    rmark_alloc_header *header = malloc(sizeof(rmark_alloc_header) + size);
+    if (!header)
+        return NULL;
+    header->arena = NULL;
+    header->size = size;
+    rmark_stats_alloc(sizeof(rmark_alloc_header) + size, 0);
+    return header + 1;
+}
+
+void *rmark_alloc(size_t size) {
+    void *ptr = NULL;
+    if (rmark_current_arena)
+        ptr = rmark_arena_alloc(rmark_current_arena, size);
+    if (!ptr)
+        ptr = rmark_malloc_alloc(size);
+    return ptr;
+}
+
+size_t rmark_alloc_size(void *ptr) {
+    return ptr ? RMARK_HEADER(ptr)->size : 0;
+}
+
+void rmark_mem_free(void *ptr) {
+    if (!ptr)
+        return;
+    if (rmark_positions.count > 0)
+        rmark_position_drop(ptr);
+    rmark_alloc_header *header = RMARK_HEADER(ptr);
+    if (header->arena) {
+        rmark_arena_free(header->arena, ptr);
+    } else {
+        rmark_stats_alloc(0, sizeof(rmark_alloc_header) + header->size);
+        free(header);
+    }
+}
+
+// cmark expects allocations to succeed, so give up like its default allocator
+// does, by asking it for an impossible amount of memory.
+void *rmark_out_of_memory(void) {
+    return cmark_get_default_mem_allocator()->calloc(SIZE_MAX, SIZE_MAX);
+}
+
+void *rmark_mem_calloc(size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size - sizeof(rmark_alloc_header))
+        return rmark_out_of_memory();
+    void *ptr = rmark_alloc(count * size);
+    if (!ptr)
+        return rmark_out_of_memory();
+    memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void *rmark_mem_realloc(void *ptr, size_t size) {
+    if (!ptr)
+        return rmark_mem_calloc(1, size);
+    rmark_alloc_header *header = RMARK_HEADER(ptr);
+    if (header->arena && rmark_arena_resize(header->arena, ptr, size))
+        return ptr;
+    if (!header->arena) {
+        size_t old_size = header->size;
+        rmark_alloc_header *new_header = realloc(header, sizeof(rmark_alloc_header) + size);
+        if (!new_header)
+            return rmark_out_of_memory();
+        new_header->size = size;
+        rmark_stats_alloc(size, old_size);
+        return new_header + 1;
+    }
+    void *new_ptr = rmark_mem_calloc(1, size);
+    memcpy(new_ptr, ptr, header->size < size ? header->size : size);
+    rmark_mem_free(ptr);
+    return new_ptr;
+}
+
+cmark_mem rmark_mem = { rmark_mem_calloc, rmark_mem_realloc, rmark_mem_free };
+
+// Like cmark_parse_document(), but with our allocator.
+cmark_node *rmark_parse_document(const char *data, size_t length, int options) {
+    cmark_parser *parser = cmark_parser_new_with_mem(options, &rmark_mem);
+    cmark_parser_feed(parser, data, length);
+    cmark_node *root = cmark_parser_finish(parser);
+    cmark_parser_free(parser);
+    return root;
+}
+
+// Parse into a new arena if asked to. Doesn't touch R, so no errors can
+// leave the arena current, and it's safe to call from worker threads.
+cmark_node *rmark_parse_document_arena(const char *data, size_t length, int options, bool use_arena) {
+    rmark_arena *arena = (use_arena) ? rmark_arena_new() : NULL;
+    rmark_current_arena = arena;
+    cmark_node *root = rmark_parse_document(data, length, options);
+    if (arena)
+        rmark_arena_seal(arena);
+    return root;
+}
+
+double rmark_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Count calls and time since `start`. Only called from the main thread.
+void rmark_stats_parsed(double start, double calls) {
+    rmark_process_stats.parse_calls += calls;
+    rmark_process_stats.parse_seconds += rmark_now() - start;
+}
+
+void rmark_stats_rendered(double start, double calls) {
+    rmark_process_stats.render_calls += calls;
+    rmark_process_stats.render_seconds += rmark_now() - start;
+}
+
+/** Render Cache */
+
+// Trees can keep the rendered output of their top-level blocks, keyed by the
+// block, output format and width. Changes through R drop the entries of the
+// block they touch, so the next render only renders those blocks again. For
+// formats where a document isn't the concatenation of its blocks, the whole
+// document is cached instead, keyed by the document node.
+
+typedef struct rmark_render_entry {
+    cmark_node *block;
+    int format;
+    int width;
+    char *output; // From rmark_mem, like all cmark output.
+    size_t length;
+    struct rmark_render_entry *next; // Next entry in the same bucket.
+} rmark_render_entry;
+
+typedef struct {
+    rmark_render_entry **buckets;
+    int capacity; // Always a power of two.
+    int count;
+    double bytes;
+} rmark_render_cache;
+
+#define RMARK_RENDER_CACHE_MIN_CAPACITY 16
+
+rmark_render_cache *rmark_render_cache_new(void) {
+    rmark_render_cache *cache = R_Calloc(1, rmark_render_cache);
+    cache->buckets = R_Calloc(RMARK_RENDER_CACHE_MIN_CAPACITY, rmark_render_entry *);
+    cache->capacity = RMARK_RENDER_CACHE_MIN_CAPACITY;
+    return cache;
+}
+
+void rmark_render_entry_free(rmark_render_cache *cache, rmark_render_entry *entry) {
+    cache->count--;
+    cache->bytes -= sizeof(rmark_render_entry) + entry->length + 1;
+    rmark_mem_free(entry->output);
+    R_Free(entry);
+}
+
+rmark_render_entry *rmark_render_cache_find(rmark_render_cache *cache, cmark_node *block, int format, int width) {
+    rmark_render_entry *entry = cache->buckets[rmark_node_hash(block, cache->capacity)];
+    for (; entry; entry = entry->next) {
+        if (entry->block == block && entry->format == format && entry->width == width)
+            return entry;
+    }
+    return NULL;
+}
+
+// Take ownership of the output of a block.
+rmark_render_entry *rmark_render_cache_store(rmark_render_cache *cache, cmark_node *block, int format, int width, char *output) {
+    if (cache->count >= cache->capacity) {
+        int capacity = 2 * cache->capacity;
+        rmark_render_entry **buckets = R_Calloc(capacity, rmark_render_entry *);
+        for (int i = 0; i < cache->capacity; i++) {
+            rmark_render_entry *entry = cache->buckets[i];
+            while (entry) {
+                rmark_render_entry *next = entry->next;
+                int j = rmark_node_hash(entry->block, capacity);
+                entry->next = buckets[j];
+                buckets[j] = entry;
+                entry = next;
+            }
+        }
+        R_Free(cache->buckets);
+        cache->buckets = buckets;
+        cache->capacity = capacity;
+    }
+
+    rmark_render_entry *entry = R_Calloc(1, rmark_render_entry);
+    *entry = (rmark_render_entry) { block, format, width, output, strlen(output), NULL };
+    int i = rmark_node_hash(block, cache->capacity);
+    entry->next = cache->buckets[i];
+    cache->buckets[i] = entry;
+    cache->count++;
+    cache->bytes += sizeof(rmark_render_entry) + entry->length + 1;
+    return entry;
+}
+
+// Drop the entries of a block for all formats and widths.
+void rmark_render_cache_drop(rmark_render_cache *cache, cmark_node *block) {
+    rmark_render_entry **link = &cache->buckets[rmark_node_hash(block, cache->capacity)];
+    while (*link) {
+        rmark_render_entry *entry = *link;
+        if (entry->block == block) {
+            *link = entry->next;
+            rmark_render_entry_free(cache, entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+void rmark_render_cache_clear(rmark_render_cache *cache) {
+    for (int i = 0; i < cache->capacity; i++) {
+        rmark_render_entry *entry = cache->buckets[i];
+        while (entry) {
+            rmark_render_entry *next = entry->next;
+            rmark_render_entry_free(cache, entry);
+            entry = next;
+        }
+        cache->buckets[i] = NULL;
+    }
+}
+
+void rmark_render_cache_free(rmark_render_cache *cache) {
+    if (!cache)
+        return;
+    rmark_render_cache_clear(cache);
+    R_Free(cache->buckets);
+    R_Free(cache);
+}
+
+/** Line Shifts */
+
+// cmark can't update source positions, so md_reparse() keeps line offsets in
+// the registry of the tree instead: for the document, and for top-level
+// blocks that were reparsed or moved down by an edit. Other nodes use the
+// offset of their closest ancestor below the document. Blocks that move to
+// another tree leave their offset behind.
+
+typedef struct rmark_shift_entry {
+    cmark_node *block;
+    int shift;
+    struct rmark_shift_entry *next; // Next entry in the same bucket.
+} rmark_shift_entry;
+
+typedef struct {
+    rmark_shift_entry **buckets;
+    int capacity; // Always a power of two.
+    int count;
+} rmark_shift_table;
+
+#define RMARK_SHIFT_TABLE_MIN_CAPACITY 16
+
+rmark_shift_table *rmark_shift_table_new(void) {
+    rmark_shift_table *table = R_Calloc(1, rmark_shift_table);
+    table->buckets = R_Calloc(RMARK_SHIFT_TABLE_MIN_CAPACITY, rmark_shift_entry *);
+    table->capacity = RMARK_SHIFT_TABLE_MIN_CAPACITY;
+    return table;
+}
+
+rmark_shift_entry *rmark_shift_table_find(rmark_shift_table *table, cmark_node *block) {
+    rmark_shift_entry *entry = table->buckets[rmark_node_hash(block, table->capacity)];
+    for (; entry; entry = entry->next) {
+        if (entry->block == block)
+            return entry;
+    }
+    return NULL;
+}
+
+void rmark_shift_table_drop(rmark_shift_table *table, cmark_node *block) {
+    rmark_shift_entry **link = &table->buckets[rmark_node_hash(block, table->capacity)];
+    while (*link) {
+        rmark_shift_entry *entry = *link;
+        if (entry->block == block) {
+            *link = entry->next;
+            R_Free(entry);
+            table->count--;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+// Set the offset of a block. Blocks without an offset don't need an entry.
+void rmark_shift_table_set(rmark_shift_table *table, cmark_node *block, int shift) {
+    rmark_shift_entry *entry = rmark_shift_table_find(table, block);
+    if (shift == 0) {
+        if (entry)
+            rmark_shift_table_drop(table, block);
+        return;
+    }
+    if (entry) {
+        entry->shift = shift;
+        return;
+    }
+
+    if (table->count >= table->capacity) {
+        int capacity = 2 * table->capacity;
+        rmark_shift_entry **buckets = R_Calloc(capacity, rmark_shift_entry *);
+        for (int i = 0; i < table->capacity; i++) {
+            rmark_shift_entry *old = table->buckets[i];
+            while (old) {
+                rmark_shift_entry *next = old->next;
+                int j = rmark_node_hash(old->block, capacity);
+                old->next = buckets[j];
+                buckets[j] = old;
+                old = next;
+            }
+        }
+        R_Free(table->buckets);
+        table->buckets = buckets;
+        table->capacity = capacity;
+    }
+
+    entry = R_Calloc(1, rmark_shift_entry);
+    int i = rmark_node_hash(block, table->capacity);
+    *entry = (rmark_shift_entry) { block, shift, table->buckets[i] };
+    table->buckets[i] = entry;
+    table->count++;
+}
+
+void rmark_shift_table_free(rmark_shift_table *table) {
+    if (!table)
+        return;
+    for (int i = 0; i < table->capacity; i++) {
+        rmark_shift_entry *entry = table->buckets[i];
+        while (entry) {
+            rmark_shift_entry *next = entry->next;
+            R_Free(entry);
+            entry = next;
+        }
+    }
+    R_Free(table->buckets);
+    R_Free(table);
+}
+
+/** Node Registry */
+
+// Every tree keeps a registry of the R wrappers that point into it, so that
+// we can hand out the same wrapper for the same node, and find the wrappers
+// that need to move when a subtree is adopted into another tree.
+//
+// The registry is an open addressing hash table with linear probing. Keys are
+// cmark nodes kept in C memory; values are weak references (key: external
+// pointer, value: R node) kept at the same index in an R list. References go
+// stale when R collects the wrapper; stale slots are dropped when we rehash.
+
+typedef struct {
+    cmark_node **keys;
+    int capacity; // Always a power of two.
+    int count; // Occupied slots, including stale references.
+
+    // Statistics for md_stats().
+    double pruned; // Stale references dropped when rehashing.
+    double adoptions; // Subtrees adopted into this tree.
+    double adoption_scans; // Adoptions that scanned the old registry.
+    double adoption_visited; // Nodes or references visited by adoptions.
+    double render_hits; // Blocks reused from the render cache.
+    double render_rerenders; // Blocks rendered into the render cache.
+
+    rmark_render_cache *render_cache; // NULL until a cached render.
+    rmark_shift_table *line_shifts; // NULL until a reparse.
+
+    // The last serialization session that wrote the tree, and its index there.
+    uint64_t serial_session;
+    int serial_index;
+} rmark_registry;
+
+#define RMARK_REGISTRY_MIN_CAPACITY 8
+
+#define REGISTRY(x) ((rmark_registry *)R_ExternalPtrAddr(x))
+#define REGISTRY_REFS(x) R_ExternalPtrProtected(x)
+
+void rmark_finalize_registry_ptr(SEXP x) {
+    rmark_registry *registry = REGISTRY(x);
+    if (registry) {
+        rmark_render_cache_free(registry->render_cache);
+        rmark_shift_table_free(registry->line_shifts);
+        R_Free(registry->keys);
+        R_Free(registry);
+        R_ClearExternalPtr(x);
+    }
+}
+
+SEXP rmark_registry_new(void) {
+    SEXP refs = PROTECT(Rf_allocVector(VECSXP, RMARK_REGISTRY_MIN_CAPACITY));
+    SEXP ptr = PROTECT(R_MakeExternalPtr(NULL, rmark_registry_symbol, refs));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_registry_ptr);
+
+    rmark_registry *registry = R_Calloc(1, rmark_registry);
+    registry->keys = R_Calloc(RMARK_REGISTRY_MIN_CAPACITY, cmark_node *);
+    registry->capacity = RMARK_REGISTRY_MIN_CAPACITY;
+    R_SetExternalPtrAddr(ptr, registry);
+
+    UNPROTECT(2);
+    return ptr;
+}
+
+// Find the slot for a node, or -1 if it's not registered.
+int rmark_registry_find(rmark_registry *registry, cmark_node *node) {
+    int mask = registry->capacity - 1;
+    for (int i = rmark_node_hash(node, registry->capacity); registry->keys[i]; i = (i + 1) & mask) {
+        if (registry->keys[i] == node) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool rmark_registry_ref_is_live(SEXP ref) {
+    return ref != R_NilValue && R_WeakRefKey(ref) != R_NilValue;
+}
+
+// Rebuild the table without stale references, growing it if needed.
+void rmark_registry_rehash(SEXP x) {
+    rmark_registry *registry = REGISTRY(x);
+    SEXP old_refs = PROTECT(REGISTRY_REFS(x));
+    cmark_node **old_keys = registry->keys;
+    int old_capacity = registry->capacity;
+
+    int live = 0;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_keys[i] && rmark_registry_ref_is_live(VECTOR_ELT(old_refs, i)))
+            live++;
+    }
+
+    // Leave room to grow so that rehashing stays amortized constant time.
+    int capacity = RMARK_REGISTRY_MIN_CAPACITY;
+    while (capacity < 2 * (live + 1))
+        capacity *= 2;
+
+    SEXP refs = PROTECT(Rf_allocVector(VECSXP, capacity));
+    cmark_node **keys = R_Calloc(capacity, cmark_node *);
+    int count = 0;
+    for (int i = 0; i < old_capacity; i++) {
+        SEXP ref = VECTOR_ELT(old_refs, i);
+        if (old_keys[i] && rmark_registry_ref_is_live(ref)) {
+            int j = rmark_node_hash(old_keys[i], capacity);
+            while (keys[j])
+                j = (j + 1) & (capacity - 1);
+            keys[j] = old_keys[i];
+            SET_VECTOR_ELT(refs, j, ref);
+            count++;
+        }
+    }
+
+    R_Free(old_keys);
+    registry->pruned += registry->count - count;
+    registry->keys = keys;
+    registry->capacity = capacity;
+    registry->count = count;
+    R_SetExternalPtrProtected(x, refs);
+
+    UNPROTECT(2);
+}
+
+// Get the R node registered for a node, or NULL if there isn't a live one.
+SEXP rmark_registry_get(SEXP x, cmark_node *node) {
+    int i = rmark_registry_find(REGISTRY(x), node);
+    if (i < 0) {
+        return R_NilValue;
+    }
+    SEXP ref = VECTOR_ELT(REGISTRY_REFS(x), i);
+    return rmark_registry_ref_is_live(ref) ? R_WeakRefValue(ref) : R_NilValue;
+}
+
+void rmark_registry_set(SEXP x, cmark_node *node, SEXP ref) {
+    rmark_registry *registry = REGISTRY(x);
+    int i = rmark_registry_find(registry, node);
+    if (i < 0) {
+        // Keep the load factor at most 3/4 so that probes always terminate.
+        if (4 * (registry->count + 1) > 3 * registry->capacity) {
+            PROTECT(ref);
+            rmark_registry_rehash(x);
+            UNPROTECT(1);
+        }
+        int mask = registry->capacity - 1;
+        i = rmark_node_hash(node, registry->capacity);
+        while (registry->keys[i])
+            i = (i + 1) & mask;
+        registry->keys[i] = node;
+        registry->count++;
+    }
+    SET_VECTOR_ELT(REGISTRY_REFS(x), i, ref);
+}
+
+// Remove a node from the registry, shifting back entries in its probe run.
+void rmark_registry_remove(SEXP x, cmark_node *node) {
+    rmark_registry *registry = REGISTRY(x);
+    int i = rmark_registry_find(registry, node);
+    if (i < 0) {
+        return;
+    }
+    SEXP refs = REGISTRY_REFS(x);
+    int mask = registry->capacity - 1;
+    for (int j = (i + 1) & mask; registry->keys[j]; j = (j + 1) & mask) {
+        int k = rmark_node_hash(registry->keys[j], registry->capacity);
+        // Entries whose home slot is cyclically in (i, j] can stay put.
+        bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            registry->keys[i] = registry->keys[j];
+            SET_VECTOR_ELT(refs, i, VECTOR_ELT(refs, j));
+            i = j;
+        }
+    }
+    registry->keys[i] = NULL;
+    SET_VECTOR_ELT(refs, i, R_NilValue);
+    registry->count--;
+}
+
+// Mark the top-level block containing a node as changed, dropping its render
+// cache entries and those of the whole document. Changing the document node
+// itself only affects the whole document. Call this before unlinking a node,
+// while its block can still be found.
+void rmark_tree_touch(SEXP root, cmark_node *node) {
+    rmark_render_cache *cache = REGISTRY(R_ExternalPtrProtected(root))->render_cache;
+    if (!cache)
+        return;
+    cmark_node *block = node, *parent = NULL;
+    while ((parent = cmark_node_parent(block)) && cmark_node_get_type(parent) != CMARK_NODE_DOCUMENT)
+        block = parent;
+    if (parent) {
+        rmark_render_cache_drop(cache, block);
+        block = parent;
+    }
+    rmark_render_cache_drop(cache, block);
+}
+
+// Mark the whole subtree of a node as changed.
+void rmark_tree_touch_subtree(SEXP root, cmark_node *node) {
+    rmark_render_cache *cache = REGISTRY(R_ExternalPtrProtected(root))->render_cache;
+    if (cache && cmark_node_get_type(node) == CMARK_NODE_DOCUMENT)
+        rmark_render_cache_clear(cache);
+    else
+        rmark_tree_touch(root, node);
+}
+
+/** Trees */
+
+// Register an external pointer in a tree and give it an R node wrapper.
+SEXP rmark_tree_register_ptr(SEXP registry, SEXP ptr) {
+    SEXP r_node = PROTECT(rmark_r_node_new(ptr));
+    MARK_NOT_MUTABLE(r_node); // Shared by all callers that ask for this node.
+    SEXP ref = PROTECT(R_MakeWeakRef(ptr, r_node, R_NilValue, FALSE));
+    rmark_registry_set(registry, R_ExternalPtrAddr(ptr), ref);
+    UNPROTECT(2);
+    return r_node;
+}
+
 SEXP rmark_tree_new(cmark_node *node) {
-    SEXP ptr = PROTECT(R_MakeExternalPtr(node, rmark_root_symbol, R_NilValue));
+    SEXP registry = PROTECT(rmark_registry_new());
+    SEXP ptr = PROTECT(R_MakeExternalPtr(node, rmark_root_symbol, registry));
     R_RegisterCFinalizer(ptr, &rmark_finalize_node_ptr);
 
-    // Keep a reference to self to move if we get adopted into another tree.
-    SEXP ref = PROTECT(R_MakeWeakRef(ptr, R_NilValue, R_NilValue, FALSE));
-    R_SetExternalPtrProtected(ptr, CONS(ref, R_NilValue));
+    // Register self to be moved if we get adopted into another tree.
+    SEXP r_node = rmark_tree_register_ptr(registry, ptr);
 
     UNPROTECT(2);
-    return ptr;
+    return r_node;
 }
 
 SEXP rmark_tree_make_node(SEXP root, cmark_node *node) {
+    SEXP registry = R_ExternalPtrProtected(root);
+    SEXP r_node = rmark_registry_get(registry, node);
+    if (r_node != R_NilValue) {
+        return r_node;
+    }
+
     // Protect root to ensure we don't get deallocated while we live.
     SEXP ptr = PROTECT(R_MakeExternalPtr(node, rmark_node_symbol, root));
     R_RegisterCFinalizer(ptr, &rmark_finalize_node_ptr);
+    r_node = rmark_tree_register_ptr(registry, ptr);
 
-    // Add weak reference to root so that we can be moved when unlinked.
-    SEXP ref = PROTECT(R_MakeWeakRef(ptr, R_NilValue, R_NilValue, FALSE));
-    SEXP refs = R_ExternalPtrProtected(root);
-    while (refs != R_NilValue && R_WeakRefKey(CAR(refs)) == R_NilValue)
-        refs = CDR(refs); // Quick clean-up of some invalidated refs.
-    R_SetExternalPtrProtected(root, CONS(ref, refs));
+    UNPROTECT(1);
+    return r_node;
+}
 
-    UNPROTECT(2);
-    return ptr;
+// Step to the next node in pre-order without leaving the subtree of top.
+cmark_node *rmark_preorder_next(cmark_node *node, cmark_node *top) {
+    cmark_node *child = cmark_node_first_child(node);
+    if (child) {
+        return child;
+    }
+    while (node != top && !cmark_node_next(node))
+        node = cmark_node_parent(node);
+    return (node == top) ? NULL : cmark_node_next(node);
 }
 
 // Debugging purposes only.
 SEXP rmark_r_node_list_root_refs(SEXP r_node) {
-    SEXP refs = R_ExternalPtrProtected(ROOT(r_node));
-    SEXP list = R_NilValue;
-    for (SEXP cell = refs; cell != R_NilValue; cell = CDR(cell))
-        list = CONS(R_WeakRefKey(CAR(cell)), list);
-    return Rf_PairToVectorList(list);
+    SEXP registry = R_ExternalPtrProtected(ROOT(r_node));
+    SEXP refs = REGISTRY_REFS(registry);
+    SEXP list = PROTECT(Rf_allocVector(VECSXP, REGISTRY(registry)->count));
+    for (int i = 0, j = 0; i < REGISTRY(registry)->capacity; i++) {
+        if (REGISTRY(registry)->keys[i])
+            SET_VECTOR_ELT(list, j++, R_WeakRefKey(VECTOR_ELT(refs, i)));
+    }
+    UNPROTECT(1);
+    return list;
+}
+
+#define make_r_root(node) rmark_tree_new(node)
+#define make_r_node(root, node) rmark_tree_make_node(root, node)
+
+// Line offsets of blocks after md_reparse(), kept in the registry of `root`.
+
+void rmark_set_line_shift(SEXP root, cmark_node *block, int shift) {
+    rmark_registry *registry = REGISTRY(R_ExternalPtrProtected(root));
+    if (!registry->line_shifts)
+        registry->line_shifts = rmark_shift_table_new();
+    rmark_shift_table_set(registry->line_shifts, block, shift);
+}
+
+// Only the document and top-level blocks have offsets of their own.
+int rmark_own_line_shift(SEXP root, cmark_node *block) {
+    rmark_shift_table *table = REGISTRY(R_ExternalPtrProtected(root))->line_shifts;
+    rmark_shift_entry *entry = (table && table->count > 0) ? rmark_shift_table_find(table, block) : NULL;
+    return (entry) ? entry->shift : 0;
+}
+
+int rmark_line_shift(SEXP root, cmark_node *node) {
+    rmark_shift_table *table = REGISTRY(R_ExternalPtrProtected(root))->line_shifts;
+    if (!table || table->count == 0)
+        return 0;
+    cmark_node *block = node;
+    for (cmark_node *parent = cmark_node_parent(block); parent; parent = cmark_node_parent(parent)) {
+        if (cmark_node_get_type(parent) == CMARK_NODE_DOCUMENT)
+            break;
+        block = parent;
+    }
+    rmark_shift_entry *entry = rmark_shift_table_find(table, block);
+    return (entry) ? entry->shift : 0;
 }
 
-#define make_r_root(node) rmark_r_node_new(rmark_tree_new(node))
-#define make_r_node(root, node) rmark_r_node_new(rmark_tree_make_node(root, node))
+// Nodes made from R have no position, shown as line 0.
+int rmark_shift_line(int line, int shift) {
+    return (line > 0) ? line + shift : line;
+}
+
+// The source position of a node in the tree of `root`, offsets included.
+rmark_position rmark_tree_position(SEXP root, cmark_node *node) {
+    rmark_position position = rmark_node_position(node);
+    int shift = rmark_line_shift(root, node);
+    position.start_line = rmark_shift_line(position.start_line, shift);
+    position.end_line = rmark_shift_line(position.end_line, shift);
+    return position;
+}
 
 /** Classification */
 
@@ -115,14 +1020,99 @@ SEXP rmark_node_is_leaf(SEXP x) {
     return Rf_ScalarLogical(cmark_node_is_leaf(NODE(x)));
 }
 
+// Nodes that cmark iterators only enter, and never exit.
+bool rmark_iter_is_leaf(cmark_node *node) {
+    switch (cmark_node_get_type(node)) {
+        case CMARK_NODE_HTML_BLOCK:
+        case CMARK_NODE_THEMATIC_BREAK:
+        case CMARK_NODE_CODE_BLOCK:
+        case CMARK_NODE_TEXT:
+        case CMARK_NODE_SOFTBREAK:
+        case CMARK_NODE_LINEBREAK:
+        case CMARK_NODE_CODE:
+        case CMARK_NODE_HTML_INLINE:
+            return true;
+        default:
+            return false;
+    }
+}
+
 /** Creating Nodes */
 
 SEXP rmark_node_new(SEXP type) {
     cmark_node_type node_type = INTEGER(type)[0];
-    cmark_node *node = cmark_node_new(node_type);
+    cmark_node *node = cmark_node_new_with_mem(node_type, &rmark_mem);
     return make_r_root(node);
 }
 
+// Copy a node and its attributes, but not its links or source position.
+cmark_node *rmark_node_copy(cmark_node *node) {
+    cmark_node *copy = cmark_node_new_with_mem(cmark_node_get_type(node), &rmark_mem);
+    switch (cmark_node_get_type(node)) {
+    case CMARK_NODE_CODE_BLOCK:
+        cmark_node_set_fence_info(copy, cmark_node_get_fence_info(node));
+        // Fall through
+    case CMARK_NODE_HTML_BLOCK:
+    case CMARK_NODE_TEXT:
+    case CMARK_NODE_CODE:
+    case CMARK_NODE_HTML_INLINE:
+        cmark_node_set_literal(copy, cmark_node_get_literal(node));
+        break;
+    case CMARK_NODE_HEADING:
+        cmark_node_set_heading_level(copy, cmark_node_get_heading_level(node));
+        break;
+    case CMARK_NODE_LIST:
+        cmark_node_set_list_type(copy, cmark_node_get_list_type(node));
+        cmark_node_set_list_delim(copy, cmark_node_get_list_delim(node));
+        cmark_node_set_list_start(copy, cmark_node_get_list_start(node));
+        cmark_node_set_list_tight(copy, cmark_node_get_list_tight(node));
+        break;
+    case CMARK_NODE_LINK:
+    case CMARK_NODE_IMAGE:
+        cmark_node_set_url(copy, cmark_node_get_url(node));
+        cmark_node_set_title(copy, cmark_node_get_title(node));
+        break;
+    case CMARK_NODE_CUSTOM_BLOCK:
+    case CMARK_NODE_CUSTOM_INLINE:
+        cmark_node_set_on_enter(copy, cmark_node_get_on_enter(node));
+        cmark_node_set_on_exit(copy, cmark_node_get_on_exit(node));
+        break;
+    default:
+        break;
+    }
+    return copy;
+}
+
+// Deep copy the subtree of a node into a new standalone tree. Copies keep
+// the source positions of their originals, with the line offsets of the tree
+// of `root` applied; pass R_NilValue for nodes outside of R trees.
+cmark_node *rmark_tree_clone(SEXP root, cmark_node *top) {
+    cmark_node *clone = NULL, *parent = NULL;
+    cmark_iter *iter = cmark_iter_new(top);
+    cmark_event_type event;
+    while ((event = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+        if (event == CMARK_EVENT_EXIT) {
+            parent = cmark_node_parent(parent);
+            continue;
+        }
+        cmark_node *node = cmark_iter_get_node(iter);
+        cmark_node *copy = rmark_node_copy(node);
+        rmark_position_set(copy, Rf_isNull(root) ? rmark_node_position(node) : rmark_tree_position(root, node));
+        if (parent)
+            cmark_node_append_child(parent, copy);
+        else
+            clone = copy;
+        if (!rmark_iter_is_leaf(node))
+            parent = copy;
+    }
+    cmark_iter_free(iter);
+    return clone;
+}
+
+SEXP rmark_node_clone(SEXP x) {
+    return make_r_root(rmark_tree_clone(ROOT(x), NODE(x)));
+}
+
 /** Tree Traversal */
 
 SEXP rmark_node_next(SEXP x) {
@@ -152,8 +1142,6 @@ SEXP rmark_node_last_child(SEXP x) {
 
 /** Iteration */
 
-// TODO: Expose full iterator API to R?
-
 const char *rmark_cmark_event_type_string(cmark_event_type event) {
     switch (event) {
         case CMARK_EVENT_NONE:  return "none";
@@ -168,12 +1156,38 @@ void rmark_finalize_iter_ptr(SEXP x) {
     cmark_iter_free(R_ExternalPtrAddr(x));
 }
 
-SEXP rmark_iterate(SEXP x, SEXP callback, SEXP envir) {
+// Turn a vector of node type codes into a lookup table. NULL selects all types.
+void rmark_node_type_filter(SEXP types, bool *selected, int size) {
+    for (int i = 0; i < size; i++)
+        selected[i] = Rf_isNull(types);
+    for (R_xlen_t i = 0; i < Rf_xlength(types); i++) {
+        int type = INTEGER(types)[i];
+        if (type > 0 && type < size)
+            selected[type] = true;
+    }
+}
+
+#define RMARK_NODE_TYPE_COUNT (CMARK_NODE_LAST_INLINE + 1)
+
+SEXP rmark_iterate(SEXP x, SEXP callback, SEXP envir, SEXP types, SEXP events) {
     if (!Rf_isFunction(callback))
         Rf_error("`callback` must be a function.");
     if (!Rf_isEnvironment(envir))
         Rf_error("`envir` must be an environment.");
 
+    // Filters are checked here so that we only call into R for matching nodes.
+    bool selected[RMARK_NODE_TYPE_COUNT];
+    rmark_node_type_filter(types, selected, RMARK_NODE_TYPE_COUNT);
+    bool on_enter = LOGICAL(events)[0];
+    bool on_exit = LOGICAL(events)[1];
+
+    // The call and event strings are reused for every event.
+    SEXP r_enter = PROTECT(Rf_mkString(rmark_cmark_event_type_string(CMARK_EVENT_ENTER)));
+    SEXP r_exit = PROTECT(Rf_mkString(rmark_cmark_event_type_string(CMARK_EVENT_EXIT)));
+    MARK_NOT_MUTABLE(r_enter);
+    MARK_NOT_MUTABLE(r_exit);
+    SEXP r_call = PROTECT(Rf_lang3(callback, R_NilValue, R_NilValue));
+
     cmark_iter *iter = cmark_iter_new(NODE(x));
     cmark_event_type event = {0};
 
@@ -182,24 +1196,270 @@ SEXP rmark_iterate(SEXP x, SEXP callback, SEXP envir) {
     R_RegisterCFinalizer(ptr, &rmark_finalize_iter_ptr);
 
     while ((event = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
-        const char *event_string = rmark_cmark_event_type_string(event);
+        if (!((event == CMARK_EVENT_ENTER && on_enter) || (event == CMARK_EVENT_EXIT && on_exit)))
+            continue;
         cmark_node *node = cmark_iter_get_node(iter);
-        SEXP r_node = PROTECT(make_r_node(ROOT(x), node));
-        SEXP r_event = PROTECT(Rf_mkString(event_string));
-        SEXP r_call = PROTECT(Rf_lang3(callback, r_node, r_event));
-        Rf_eval(r_call, envir);
-        UNPROTECT(3);
+        cmark_node_type type = cmark_node_get_type(node);
+        if (type <= 0 || type >= RMARK_NODE_TYPE_COUNT || !selected[type])
+            continue;
+
+        SEXP r_node = make_r_node(ROOT(x), node);
+        SETCADR(r_call, r_node);
+        SETCADDR(r_call, (event == CMARK_EVENT_ENTER) ? r_enter : r_exit);
+        SEXP result = Rf_eval(r_call, envir);
+
+        // Skip to the exit event of a node if asked to. Only possible if the
+        // node has children to skip, and is still in the iterated tree.
+        // Resetting makes the given event the current one, so reset to the
+        // last event of the last child to have the exit of the node next.
+        if (event == CMARK_EVENT_ENTER && Rf_inherits(result, "rmark_skip_children")) {
+            cmark_node *ancestor = node;
+            while (ancestor && ancestor != cmark_iter_get_root(iter))
+                ancestor = cmark_node_parent(ancestor);
+            cmark_node *last = cmark_node_last_child(node);
+            if (ancestor && last)
+                cmark_iter_reset(iter, last, rmark_iter_is_leaf(last) ? CMARK_EVENT_ENTER : CMARK_EVENT_EXIT);
+        }
+        SETCADR(r_call, R_NilValue); // Don't keep the node alive.
     }
 
-    UNPROTECT(1);
+    UNPROTECT(4);
     return R_NilValue;
 }
 
-/** Accessors */
+// Iterators can also be stepped from R, a batch of events at a time. R code
+// may change the tree between steps, so rather than trust the state of the
+// cmark iterator, every step resets it to the last node it returned. That
+// node is kept alive by holding its R node.
 
-#define Rf_mkStringUTF8(x) rmark_make_utf8_strsxp(x)
+typedef struct {
+    cmark_iter *iter;
+    cmark_node *node; // Last node stepped over, or the next one if pending.
+    cmark_event_type event;
+    bool pending; // Whether the event on node is yet to be returned.
+    bool done;
+    bool selected[RMARK_NODE_TYPE_COUNT];
+    bool on_enter;
+    bool on_exit;
 
-SEXP rmark_make_utf8_strsxp(const char *string) {
+    // Pre-order ids: the last id entered, and the ids of open nodes.
+    int id;
+    int *stack;
+    int stack_size;
+    int stack_capacity;
+} rmark_iterator;
+
+// Slots of the vector in the protected slot of iterator pointers.
+enum { RMARK_ITER_TOP, RMARK_ITER_CURRENT, RMARK_ITER_HELD };
+
+void rmark_finalize_iterator_ptr(SEXP x) {
+    rmark_iterator *it = R_ExternalPtrAddr(x);
+    if (it) {
+        cmark_iter_free(it->iter);
+        R_Free(it->stack);
+        R_Free(it);
+        R_ClearExternalPtr(x);
+    }
+}
+
+rmark_iterator *rmark_iterator_get(SEXP x) {
+    if (TYPEOF(x) != EXTPTRSXP || R_ExternalPtrTag(x) != rmark_iter_symbol)
+        Rf_error("`it` must be a Markdown iterator.");
+    rmark_iterator *it = R_ExternalPtrAddr(x);
+    if (!it)
+        Rf_error("`it` is no longer valid. Was it saved and reloaded?");
+    return it;
+}
+
+void rmark_iterator_push(rmark_iterator *it, int id) {
+    if (it->stack_size == it->stack_capacity) {
+        it->stack_capacity *= 2;
+        it->stack = R_Realloc(it->stack, it->stack_capacity, int);
+    }
+    it->stack[it->stack_size++] = id;
+}
+
+// Update the ids for an event, returning the id of its node. Changes to the
+// tree can make exits unbalanced, so they may not have an id.
+int rmark_iterator_track(rmark_iterator *it, cmark_node *node, cmark_event_type event) {
+    if (event == CMARK_EVENT_EXIT)
+        return (it->stack_size > 0) ? it->stack[--it->stack_size] : NA_INTEGER;
+    int id = ++it->id;
+    if (!rmark_iter_is_leaf(node))
+        rmark_iterator_push(it, id);
+    return id;
+}
+
+// Make an event on a node the next to be returned, and find the ids of the
+// node and its open ancestors by walking the tree up to it.
+void rmark_iterator_seek(rmark_iterator *it, cmark_node *node, cmark_event_type event) {
+    cmark_node *top = cmark_iter_get_root(it->iter);
+    int depth = 0;
+    for (cmark_node *ancestor = node; ancestor != top; ancestor = cmark_node_parent(ancestor))
+        depth++;
+    cmark_node **chain = (cmark_node **) R_alloc(depth + 1, sizeof(cmark_node *));
+    cmark_node *ancestor = node;
+    for (int i = depth; i >= 0; i--, ancestor = cmark_node_parent(ancestor))
+        chain[i] = ancestor;
+
+    it->stack_size = 0;
+    int id = 0;
+    for (cmark_node *current = top, *next = chain[0]; current; current = rmark_preorder_next(current, top)) {
+        id++;
+        if (current == node)
+            break;
+        if (current == next) {
+            rmark_iterator_push(it, id);
+            next = chain[it->stack_size];
+        }
+    }
+    if (event == CMARK_EVENT_ENTER) {
+        it->id = id - 1;
+    } else {
+        rmark_iterator_push(it, id);
+        for (cmark_node *current = rmark_preorder_next(node, node); current; current = rmark_preorder_next(current, node))
+            id++;
+        it->id = id;
+    }
+    it->node = node;
+    it->event = event;
+    it->pending = true;
+    it->done = false;
+}
+
+// Find whether a node is in the subtree of top.
+bool rmark_node_is_within(cmark_node *node, cmark_node *top) {
+    while (node && node != top)
+        node = cmark_node_parent(node);
+    return node != NULL;
+}
+
+SEXP rmark_iter_new(SEXP x, SEXP types, SEXP events) {
+    cmark_node *top = NODE(x);
+    SEXP held = PROTECT(Rf_allocVector(VECSXP, RMARK_ITER_HELD));
+    SET_VECTOR_ELT(held, RMARK_ITER_TOP, x);
+    SET_VECTOR_ELT(held, RMARK_ITER_CURRENT, x);
+    SEXP ptr = PROTECT(R_MakeExternalPtr(NULL, rmark_iter_symbol, held));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_iterator_ptr);
+
+    rmark_iterator *it = R_Calloc(1, rmark_iterator);
+    R_SetExternalPtrAddr(ptr, it);
+    it->iter = cmark_iter_new(top);
+    it->stack_capacity = 16;
+    it->stack = R_Calloc(it->stack_capacity, int);
+    rmark_node_type_filter(types, it->selected, RMARK_NODE_TYPE_COUNT);
+    it->on_enter = LOGICAL(events)[0];
+    it->on_exit = LOGICAL(events)[1];
+    rmark_iterator_seek(it, top, CMARK_EVENT_ENTER);
+
+    UNPROTECT(2);
+    return ptr;
+}
+
+// Return the next n events that pass the filters, with their nodes or ids.
+SEXP rmark_iter_next_n(SEXP x, SEXP n_events, SEXP ids) {
+    rmark_iterator *it = rmark_iterator_get(x);
+    SEXP held = R_ExternalPtrProtected(x);
+    SEXP top = VECTOR_ELT(held, RMARK_ITER_TOP);
+    int n = Rf_asInteger(n_events);
+    if (n == NA_INTEGER || n < 0)
+        Rf_error("`n` must be a non-negative integer.");
+    bool as_ids = Rf_asLogical(ids) == TRUE;
+
+    if (!it->done) {
+        if (!R_ExternalPtrAddr(PTR(VECTOR_ELT(held, RMARK_ITER_CURRENT))))
+            Rf_error("The current node of `it` was deleted.");
+        if (!rmark_node_is_within(it->node, cmark_iter_get_root(it->iter)))
+            Rf_error("The current node of `it` was moved out of the iterated tree.");
+    }
+
+    // Results grow as needed, since `n` is often just a large upper bound.
+    // They are kept in the result list to keep them protected.
+    const char *names[] = { "event", "node", "" };
+    SEXP result = PROTECT(Rf_mkNamed(VECSXP, names));
+    int capacity = (n < 1024) ? n : 1024;
+    SET_VECTOR_ELT(result, 0, Rf_allocVector(INTSXP, capacity));
+    SET_VECTOR_ELT(result, 1, Rf_allocVector((as_ids) ? INTSXP : VECSXP, capacity));
+    SEXP root = ROOT(top);
+    int count = 0;
+    if (!it->done && n > 0) {
+        cmark_iter_reset(it->iter, it->node, it->event);
+        bool first = it->pending;
+        while (count < n) {
+            cmark_event_type event = (first) ? it->event : cmark_iter_next(it->iter);
+            first = false;
+            if (event == CMARK_EVENT_DONE) {
+                it->done = true;
+                break;
+            }
+            cmark_node *node = cmark_iter_get_node(it->iter);
+            int id = rmark_iterator_track(it, node, event);
+            it->node = node;
+            it->event = event;
+            it->pending = false;
+
+            if (!((event == CMARK_EVENT_ENTER && it->on_enter) || (event == CMARK_EVENT_EXIT && it->on_exit)))
+                continue;
+            cmark_node_type type = cmark_node_get_type(node);
+            if (type <= 0 || type >= RMARK_NODE_TYPE_COUNT || !it->selected[type])
+                continue;
+
+            if (count == capacity) {
+                capacity = (capacity > n / 2) ? n : 2 * capacity;
+                for (int j = 0; j < 2; j++)
+                    SET_VECTOR_ELT(result, j, Rf_xlengthgets(VECTOR_ELT(result, j), capacity));
+            }
+            INTEGER(VECTOR_ELT(result, 0))[count] = (event == CMARK_EVENT_ENTER) ? 1 : 2;
+            if (as_ids)
+                INTEGER(VECTOR_ELT(result, 1))[count] = id;
+            else
+                SET_VECTOR_ELT(VECTOR_ELT(result, 1), count, make_r_node(root, node));
+            count++;
+        }
+        SET_VECTOR_ELT(held, RMARK_ITER_CURRENT, make_r_node(root, it->node));
+    }
+
+    for (int j = 0; j < 2; j++)
+        SET_VECTOR_ELT(result, j, Rf_xlengthgets(VECTOR_ELT(result, j), count));
+    const char *levels[] = { "enter", "exit" };
+    SEXP r_levels = PROTECT(Rf_allocVector(STRSXP, 2));
+    for (int i = 0; i < 2; i++)
+        SET_STRING_ELT(r_levels, i, Rf_mkChar(levels[i]));
+    SEXP result_events = VECTOR_ELT(result, 0);
+    Rf_setAttrib(result_events, R_LevelsSymbol, r_levels);
+    Rf_setAttrib(result_events, R_ClassSymbol, Rf_mkString("factor"));
+    UNPROTECT(2);
+    return result;
+}
+
+// Seek to an event on a node, or back to the start if node is NULL.
+SEXP rmark_iter_reset(SEXP x, SEXP node, SEXP event) {
+    rmark_iterator *it = rmark_iterator_get(x);
+    SEXP held = R_ExternalPtrProtected(x);
+    cmark_node *top = cmark_iter_get_root(it->iter);
+    if (Rf_isNull(node)) {
+        rmark_iterator_seek(it, top, CMARK_EVENT_ENTER);
+        SET_VECTOR_ELT(held, RMARK_ITER_CURRENT, VECTOR_ELT(held, RMARK_ITER_TOP));
+        return R_NilValue;
+    }
+
+    cmark_node *target = NODE(node);
+    if (!rmark_node_is_within(target, top))
+        Rf_error("`node` must be in the tree being iterated over.");
+    bool on_exit = Rf_asLogical(event) == TRUE;
+    if (on_exit && rmark_iter_is_leaf(target))
+        Rf_error("Can't seek to the exit of a <%s> node, which only has an enter event.",
+            cmark_node_get_type_string(target));
+    rmark_iterator_seek(it, target, (on_exit) ? CMARK_EVENT_EXIT : CMARK_EVENT_ENTER);
+    SET_VECTOR_ELT(held, RMARK_ITER_CURRENT, node);
+    return R_NilValue;
+}
+
+/** Accessors */
+
+#define Rf_mkStringUTF8(x) rmark_make_utf8_strsxp(x)
+
+SEXP rmark_make_utf8_strsxp(const char *string) {
     SEXP charsxp = Rf_mkCharCE(string, CE_UTF8);
     PROTECT(charsxp);
     SEXP strsxp = Rf_ScalarString(charsxp);
@@ -207,6 +1467,10 @@ SEXP rmark_make_utf8_strsxp(const char *string) {
     return strsxp;
 }
 
+SEXP rmark_make_utf8_charsxp_or_na(const char *string) {
+    return (string) ? Rf_mkCharCE(string, CE_UTF8) : NA_STRING;
+}
+
 // User data is not supported; We already have attributes in R.
 
 SEXP rmark_node_get_type_string(SEXP x) {
@@ -223,6 +1487,7 @@ SEXP rmark_node_set_literal(SEXP x, SEXP value) {
     if (!cmark_node_set_literal(NODE(x), content)) {
         Rf_error("Failed to set node literal to \"%s\".", content);
     };
+    rmark_tree_touch(ROOT(x), NODE(x));
     return x;
 }
 
@@ -236,6 +1501,7 @@ SEXP rmark_node_set_heading_level(SEXP x, SEXP value) {
     if (!cmark_node_set_heading_level(NODE(x), heading_level)) {
         Rf_error("Failed to set heading level to \"%d\".", heading_level);
     };
+    rmark_tree_touch(ROOT(x), NODE(x));
     return x;
 }
 
@@ -249,6 +1515,7 @@ SEXP rmark_node_set_list_type(SEXP x, SEXP value) {
     if (!cmark_node_set_list_type(NODE(x), list_type)) {
         Rf_error("Failed to set list type to \"%d\".", list_type);
     };
+    rmark_tree_touch(ROOT(x), NODE(x));
     return x;
 }
 
@@ -262,6 +1529,7 @@ SEXP rmark_node_set_list_delim(SEXP x, SEXP value) {
     if (!cmark_node_set_list_delim(NODE(x), list_delim)) {
         Rf_error("Failed to set list delim to \"%d\".", list_delim);
     };
+    rmark_tree_touch(ROOT(x), NODE(x));
     return x;
 }
 
@@ -275,6 +1543,7 @@ SEXP rmark_node_set_list_start(SEXP x, SEXP value) {
     if (!cmark_node_set_list_start(NODE(x), list_start)) {
         Rf_error("Failed to set list start to \"%d\".", list_start);
     };
+    rmark_tree_touch(ROOT(x), NODE(x));
     return x;
 }
 
@@ -288,6 +1557,7 @@ SEXP rmark_node_set_list_tight(SEXP x, SEXP value) {
     if (!cmark_node_set_list_tight(NODE(x), list_tight)) {
         Rf_error("Failed to set list tight to \"%d\".", list_tight);
     };
+    rmark_tree_touch(ROOT(x), NODE(x));
     return x;
 }
 
@@ -301,6 +1571,7 @@ SEXP rmark_node_set_fence_info(SEXP x, SEXP value) {
     if (!cmark_node_set_fence_info(NODE(x), info)) {
         Rf_error("Failed to set node fence info to \"%s\".", info);
     };
+    rmark_tree_touch(ROOT(x), NODE(x));
     return x;
 }
 
@@ -314,6 +1585,7 @@ SEXP rmark_node_set_url(SEXP x, SEXP value) {
     if (!cmark_node_set_url(NODE(x), url)) {
         Rf_error("Failed to set node url to \"%s\".", url);
     };
+    rmark_tree_touch(ROOT(x), NODE(x));
     return x;
 }
 
@@ -327,241 +1599,2986 @@ SEXP rmark_node_set_title(SEXP x, SEXP value) {
     if (!cmark_node_set_title(NODE(x), title)) {
         Rf_error("Failed to set node title to \"%s\".", title);
     };
+    rmark_tree_touch(ROOT(x), NODE(x));
     return x;
 }
 
 // TODO: on_enter and on_exit for custom nodes not supported.
 
 SEXP rmark_node_get_start_line(SEXP x) {
-    return Rf_ScalarInteger(cmark_node_get_start_line(NODE(x)));
+    return Rf_ScalarInteger(rmark_tree_position(ROOT(x), NODE(x)).start_line);
 }
 
 SEXP rmark_node_get_start_column(SEXP x) {
-    return Rf_ScalarInteger(cmark_node_get_start_column(NODE(x)));
+    return Rf_ScalarInteger(rmark_node_position(NODE(x)).start_column);
 }
 
 SEXP rmark_node_get_end_line(SEXP x) {
-    return Rf_ScalarInteger(cmark_node_get_end_line(NODE(x)));
+    return Rf_ScalarInteger(rmark_tree_position(ROOT(x), NODE(x)).end_line);
 }
 
 SEXP rmark_node_get_end_column(SEXP x) {
-    return Rf_ScalarInteger(cmark_node_get_end_column(NODE(x)));
+    return Rf_ScalarInteger(rmark_node_position(NODE(x)).end_column);
 }
 
-/** Tree Manipulation */
+/** Flattening */
 
-// Move a node and all its descendents to a new root. This only moves the R
-// references to ensure GC protection. Used after changing cmark node links.
-SEXP rmark_tree_adopt_node(SEXP root, SEXP node) {
-    // root == node is used to promote a node to a tree while moving refs from the old root.
-    if (R_ExternalPtrTag(root) != rmark_root_symbol && root != node)
-        Rf_error("internal error: invalid root");
-    if (R_ExternalPtrTag(node) != rmark_root_symbol && R_ExternalPtrTag(node) != rmark_node_symbol)
-        Rf_error("internal error: invalid node");
+// Nodes are identified by their 1-based position in a pre-order walk of the
+// subtree, so that parents can be referred to without creating R wrappers.
 
-    SEXP old_root = rmark_node_get_root(node);
-    if (old_root == root) {
-        return R_NilValue;
-    }
+typedef enum {
+    RMARK_COL_ID,
+    RMARK_COL_PARENT,
+    RMARK_COL_DEPTH,
+    RMARK_COL_TYPE,
+    RMARK_COL_LITERAL,
+    RMARK_COL_HEADING_LEVEL,
+    RMARK_COL_LIST_TYPE,
+    RMARK_COL_LIST_DELIM,
+    RMARK_COL_LIST_START,
+    RMARK_COL_LIST_TIGHT,
+    RMARK_COL_URL,
+    RMARK_COL_TITLE,
+    RMARK_COL_FENCE_INFO,
+    RMARK_COL_START_LINE,
+    RMARK_COL_START_COLUMN,
+    RMARK_COL_END_LINE,
+    RMARK_COL_END_COLUMN,
+    RMARK_COL_COUNT,
+} rmark_flat_column;
 
-    // Iterate old references and move any descendants of node to root.
-    SEXP old_root_refs = R_ExternalPtrProtected(old_root);
-    SEXP adopted_refs = R_NilValue; // Empty pairlist.
-    cmark_node *adopted_node = R_ExternalPtrAddr(node);
+const char *rmark_flat_column_names[RMARK_COL_COUNT] = {
+    "id", "parent", "depth", "type", "literal", "heading_level",
+    "list_type", "list_delim", "list_start", "list_tight", "url", "title",
+    "fence_info", "start_line", "start_column", "end_line", "end_column",
+};
 
-    // Also prune stale refs from old root since we have to go through the list anyway.
-    for (SEXP prev = NULL, cell = old_root_refs; cell != R_NilValue; cell = CDR(cell)) {
-        SEXP ref = CAR(cell);
-        SEXP ptr = R_WeakRefKey(ref);
-        bool should_unlink_cell = false;
+SEXPTYPE rmark_flat_column_types[RMARK_COL_COUNT] = {
+    INTSXP, INTSXP, INTSXP, STRSXP, STRSXP, INTSXP,
+    INTSXP, INTSXP, INTSXP, LGLSXP, STRSXP, STRSXP,
+    STRSXP, INTSXP, INTSXP, INTSXP, INTSXP,
+};
 
-        if (ptr == R_NilValue) {
-            should_unlink_cell = true; // Stale reference.
-        } else {
-            // Follow parent chain to check if ancestor is being moved.
-            cmark_node *ancestor_node = R_ExternalPtrAddr(ptr);
-            if (ancestor_node) {
-                do {
-                    if (ancestor_node == adopted_node) {
-                        // Link reference to new root.
-                        R_SetExternalPtrProtected(ptr, root);
-                        adopted_refs = CONS(ref, adopted_refs);
-                        should_unlink_cell = true;
-                        break;
-                    }
-                    ancestor_node = cmark_node_parent(ancestor_node);
-                } while(ancestor_node);
-            }
+// Resize all columns in place in the list `cols`.
+void rmark_flat_resize(SEXP cols, R_xlen_t size) {
+    for (R_xlen_t j = 0; j < XLENGTH(cols); j++)
+        SET_VECTOR_ELT(cols, j, Rf_xlengthgets(VECTOR_ELT(cols, j), size));
+}
+
+SEXP rmark_flatten(SEXP x, SEXP types) {
+    cmark_node *top = NODE(x);
+    SEXP root = ROOT(x);
+    bool selected[RMARK_NODE_TYPE_COUNT];
+    rmark_node_type_filter(types, selected, RMARK_NODE_TYPE_COUNT);
+
+    R_xlen_t capacity = 256, n = 0;
+    SEXP cols = PROTECT(Rf_allocVector(VECSXP, RMARK_COL_COUNT));
+    for (int j = 0; j < RMARK_COL_COUNT; j++)
+        SET_VECTOR_ELT(cols, j, Rf_allocVector(rmark_flat_column_types[j], capacity));
+
+    // Type strings are shared by many rows, so only make them once.
+    SEXP type_strings = PROTECT(Rf_allocVector(STRSXP, RMARK_NODE_TYPE_COUNT));
+
+    // Stack of open ancestors to find parent ids and depths.
+    int stack_capacity = 64, stack_size = 0;
+    cmark_node **stack_nodes = (cmark_node **) R_alloc(stack_capacity, sizeof(cmark_node *));
+    int *stack_ids = (int *) R_alloc(stack_capacity, sizeof(int));
+    int *stack_shifts = (int *) R_alloc(stack_capacity, sizeof(int));
+
+    cmark_iter *iter = cmark_iter_new(top);
+    SEXP ptr = PROTECT(R_MakeExternalPtr(iter, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_iter_ptr);
+
+    int id = 0;
+    cmark_event_type event = {0};
+    while ((event = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+        if (event != CMARK_EVENT_ENTER)
+            continue;
+        cmark_node *node = cmark_iter_get_node(iter);
+        id++;
+
+        cmark_node *parent = (node == top) ? NULL : cmark_node_parent(node);
+        while (stack_size > 0 && stack_nodes[stack_size - 1] != parent)
+            stack_size--;
+        int parent_id = (stack_size > 0) ? stack_ids[stack_size - 1] : NA_INTEGER;
+        int depth = stack_size;
+        if (stack_size == stack_capacity) {
+            stack_nodes = (cmark_node **) S_realloc((char *) stack_nodes, 2 * stack_capacity, stack_capacity, sizeof(cmark_node *));
+            stack_ids = (int *) S_realloc((char *) stack_ids, 2 * stack_capacity, stack_capacity, sizeof(int));
+            stack_shifts = (int *) S_realloc((char *) stack_shifts, 2 * stack_capacity, stack_capacity, sizeof(int));
+            stack_capacity *= 2;
         }
+        // Line shifts are inherited, so only look them up for the top node
+        // and top-level blocks, which may have their own.
+        int shift = (stack_size == 0) ? rmark_line_shift(root, node)
+            : (cmark_node_get_type(parent) == CMARK_NODE_DOCUMENT) ? rmark_own_line_shift(root, node)
+            : stack_shifts[stack_size - 1];
+        stack_nodes[stack_size] = node;
+        stack_ids[stack_size] = id;
+        stack_shifts[stack_size] = shift;
+        stack_size++;
 
-        if (should_unlink_cell) {
-            if (prev) {
-                SETCDR(prev, CDR(cell));
-            } else {
-                R_SetExternalPtrProtected(old_root, CDR(cell));
-            }
-        } else {
-            prev = cell;
+        cmark_node_type type = cmark_node_get_type(node);
+        if (type <= 0 || type >= RMARK_NODE_TYPE_COUNT || !selected[type])
+            continue;
+
+        if (n == capacity) {
+            capacity *= 2;
+            rmark_flat_resize(cols, capacity);
         }
-    }
 
-    if (root == node) {
-        R_SetExternalPtrTag(root, rmark_root_symbol);
-        R_SetExternalPtrProtected(root, adopted_refs);
-    } else {
-        // Add adopted references to root refs.
-        SEXP refs = R_ExternalPtrProtected(root);
-        while (refs != R_NilValue && R_WeakRefKey(CAR(refs)) == R_NilValue)
-            refs = CDR(refs); // Quick clean-up of some invalidated refs.
-        for (SEXP cell = adopted_refs; cell != R_NilValue; cell = CDR(cell))
-            refs = CONS(CAR(cell), refs);
-        R_SetExternalPtrProtected(root, refs);
-        R_SetExternalPtrProtected(node, root);
-        R_SetExternalPtrTag(node, rmark_node_symbol);
+        SEXP type_string = STRING_ELT(type_strings, type);
+        if (type_string == R_BlankString) {
+            type_string = Rf_mkCharCE(cmark_node_get_type_string(node), CE_UTF8);
+            SET_STRING_ELT(type_strings, type, type_string);
+        }
+
+        bool is_list = type == CMARK_NODE_LIST;
+        bool is_heading = type == CMARK_NODE_HEADING;
+        bool is_code_block = type == CMARK_NODE_CODE_BLOCK;
+
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_ID))[n] = id;
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_PARENT))[n] = parent_id;
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_DEPTH))[n] = depth;
+        SET_STRING_ELT(VECTOR_ELT(cols, RMARK_COL_TYPE), n, type_string);
+        SET_STRING_ELT(VECTOR_ELT(cols, RMARK_COL_LITERAL), n, rmark_make_utf8_charsxp_or_na(cmark_node_get_literal(node)));
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_HEADING_LEVEL))[n] = is_heading ? cmark_node_get_heading_level(node) : NA_INTEGER;
+        int list_type = is_list ? (int) cmark_node_get_list_type(node) : 0;
+        int list_delim = is_list ? (int) cmark_node_get_list_delim(node) : 0;
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_LIST_TYPE))[n] = (list_type) ? list_type : NA_INTEGER;
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_LIST_DELIM))[n] = (list_delim) ? list_delim : NA_INTEGER;
+        // Bullet lists have no start, as for md_list_start().
+        bool is_ordered = is_list && list_type == CMARK_ORDERED_LIST;
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_LIST_START))[n] = is_ordered ? cmark_node_get_list_start(node) : NA_INTEGER;
+        LOGICAL(VECTOR_ELT(cols, RMARK_COL_LIST_TIGHT))[n] = is_list ? cmark_node_get_list_tight(node) : NA_LOGICAL;
+        SET_STRING_ELT(VECTOR_ELT(cols, RMARK_COL_URL), n, rmark_make_utf8_charsxp_or_na(cmark_node_get_url(node)));
+        SET_STRING_ELT(VECTOR_ELT(cols, RMARK_COL_TITLE), n, rmark_make_utf8_charsxp_or_na(cmark_node_get_title(node)));
+        SET_STRING_ELT(VECTOR_ELT(cols, RMARK_COL_FENCE_INFO), n, is_code_block ? rmark_make_utf8_charsxp_or_na(cmark_node_get_fence_info(node)) : NA_STRING);
+        rmark_position position = rmark_node_position(node);
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_START_LINE))[n] = rmark_shift_line(position.start_line, shift);
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_START_COLUMN))[n] = position.start_column;
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_END_LINE))[n] = rmark_shift_line(position.end_line, shift);
+        INTEGER(VECTOR_ELT(cols, RMARK_COL_END_COLUMN))[n] = position.end_column;
+        n++;
     }
 
-    return R_NilValue;
-}
+    rmark_flat_resize(cols, n);
 
-SEXP rmark_node_promote_to_tree(SEXP node) {
-    return rmark_tree_adopt_node(node, node);
-}
+    SEXP names = PROTECT(Rf_allocVector(STRSXP, RMARK_COL_COUNT));
+    for (int j = 0; j < RMARK_COL_COUNT; j++)
+        SET_STRING_ELT(names, j, Rf_mkChar(rmark_flat_column_names[j]));
+    Rf_setAttrib(cols, R_NamesSymbol, names);
 
-SEXP rmark_node_unlink(SEXP x) {
-    cmark_node_unlink(NODE(x));
-    rmark_node_promote_to_tree(PTR(x));
-    return R_NilValue;
+    UNPROTECT(4);
+    return cols;
 }
 
-SEXP rmark_node_insert_before(SEXP x, SEXP new) {
-    int ok = cmark_node_insert_before(NODE(x), NODE(new));
-    if (ok) {
-        rmark_tree_adopt_node(ROOT(x), PTR(new));
+// Build a tree from columns like those of rmark_flatten(). Each row is
+// appended to the row given by its parent index, which must come earlier.
+// Missing values leave an attribute at its default.
+
+typedef enum {
+    RMARK_BUILD_TYPE,
+    RMARK_BUILD_PARENT,
+    RMARK_BUILD_LITERAL,
+    RMARK_BUILD_HEADING_LEVEL,
+    RMARK_BUILD_LIST_TYPE,
+    RMARK_BUILD_LIST_DELIM,
+    RMARK_BUILD_LIST_START,
+    RMARK_BUILD_LIST_TIGHT,
+    RMARK_BUILD_URL,
+    RMARK_BUILD_TITLE,
+    RMARK_BUILD_FENCE_INFO,
+    RMARK_BUILD_COUNT,
+} rmark_build_column;
+
+SEXP rmark_build(SEXP cols) {
+    if (TYPEOF(cols) != VECSXP || XLENGTH(cols) != RMARK_BUILD_COUNT)
+        Rf_error("internal error: invalid columns");
+    SEXP types = VECTOR_ELT(cols, RMARK_BUILD_TYPE);
+    SEXP parents = VECTOR_ELT(cols, RMARK_BUILD_PARENT);
+    R_xlen_t n = XLENGTH(types);
+    if (n == 0)
+        Rf_error("Can't build a tree without nodes.");
+    for (int j = 0; j < RMARK_BUILD_COUNT; j++) {
+        SEXP col = VECTOR_ELT(cols, j);
+        if (col != R_NilValue && XLENGTH(col) != n)
+            Rf_error("All columns must have the same length.");
     }
-    return Rf_ScalarLogical(ok);
-}
 
-SEXP rmark_node_insert_after(SEXP x, SEXP new) {
-    int ok = cmark_node_insert_after(NODE(x), NODE(new));
-    if (ok) {
-        rmark_tree_adopt_node(ROOT(x), PTR(new));
+    for (R_xlen_t i = 0; i < n; i++) {
+        int type = INTEGER(types)[i];
+        if (type <= CMARK_NODE_NONE || type > CMARK_NODE_LAST_INLINE)
+            Rf_error("Row %lld has an unknown node type.", (long long) i + 1);
+        int parent = INTEGER(parents)[i];
+        if ((i == 0) != (parent == NA_INTEGER))
+            Rf_error("Only the first row must have a missing parent.");
+        if (i > 0 && (parent < 1 || parent > i))
+            Rf_error("Row %lld must have a parent in an earlier row.", (long long) i + 1);
     }
-    return Rf_ScalarLogical(ok);
+
+    // The root owns all nodes appended to it, so they get free'd with it on errors.
+    cmark_node **nodes = (cmark_node **) R_alloc(n, sizeof(cmark_node *));
+    nodes[0] = cmark_node_new_with_mem(INTEGER(types)[0], &rmark_mem);
+    SEXP r_root = PROTECT(make_r_root(nodes[0]));
+
+    for (R_xlen_t i = 0; i < n; i++) {
+        cmark_node *node = (i == 0) ? nodes[0] : cmark_node_new_with_mem(INTEGER(types)[i], &rmark_mem);
+        nodes[i] = node;
+        if (i > 0) {
+            cmark_node *parent = nodes[INTEGER(parents)[i] - 1];
+            if (!cmark_node_append_child(parent, node)) {
+                const char *type = cmark_node_get_type_string(node);
+                cmark_node_free(node);
+                Rf_error("Can't add a <%s> node in row %lld to a <%s> node.",
+                    type, (long long) i + 1, cmark_node_get_type_string(parent));
+            }
+        }
+
+        int ok = 1;
+        SEXP col = R_NilValue;
+        if ((col = VECTOR_ELT(cols, RMARK_BUILD_LITERAL)) != R_NilValue && STRING_ELT(col, i) != NA_STRING)
+            ok &= cmark_node_set_literal(node, Rf_translateCharUTF8(STRING_ELT(col, i)));
+        if ((col = VECTOR_ELT(cols, RMARK_BUILD_HEADING_LEVEL)) != R_NilValue && INTEGER(col)[i] != NA_INTEGER)
+            ok &= cmark_node_set_heading_level(node, INTEGER(col)[i]);
+        if ((col = VECTOR_ELT(cols, RMARK_BUILD_LIST_TYPE)) != R_NilValue && INTEGER(col)[i] != NA_INTEGER)
+            ok &= cmark_node_set_list_type(node, INTEGER(col)[i]);
+        if ((col = VECTOR_ELT(cols, RMARK_BUILD_LIST_DELIM)) != R_NilValue && INTEGER(col)[i] != NA_INTEGER)
+            ok &= cmark_node_set_list_delim(node, INTEGER(col)[i]);
+        if ((col = VECTOR_ELT(cols, RMARK_BUILD_LIST_START)) != R_NilValue && INTEGER(col)[i] != NA_INTEGER)
+            ok &= cmark_node_set_list_start(node, INTEGER(col)[i]);
+        if ((col = VECTOR_ELT(cols, RMARK_BUILD_LIST_TIGHT)) != R_NilValue && LOGICAL(col)[i] != NA_LOGICAL)
+            ok &= cmark_node_set_list_tight(node, LOGICAL(col)[i]);
+        if ((col = VECTOR_ELT(cols, RMARK_BUILD_URL)) != R_NilValue && STRING_ELT(col, i) != NA_STRING)
+            ok &= cmark_node_set_url(node, Rf_translateCharUTF8(STRING_ELT(col, i)));
+        if ((col = VECTOR_ELT(cols, RMARK_BUILD_TITLE)) != R_NilValue && STRING_ELT(col, i) != NA_STRING)
+            ok &= cmark_node_set_title(node, Rf_translateCharUTF8(STRING_ELT(col, i)));
+        if ((col = VECTOR_ELT(cols, RMARK_BUILD_FENCE_INFO)) != R_NilValue && STRING_ELT(col, i) != NA_STRING)
+            ok &= cmark_node_set_fence_info(node, Rf_translateCharUTF8(STRING_ELT(col, i)));
+        if (!ok) {
+            Rf_error("Failed to set attributes of the <%s> node in row %lld.",
+                cmark_node_get_type_string(node), (long long) i + 1);
+        }
+    }
+
+    UNPROTECT(1);
+    return r_root;
 }
 
-SEXP rmark_node_replace(SEXP x, SEXP new) {
-    int ok = cmark_node_replace(NODE(x), NODE(new));
-    if (ok) {
-        rmark_tree_adopt_node(ROOT(x), PTR(new));
+/** Extraction */
+
+// Single-pass queries that collect text from a subtree into one growing
+// buffer, instead of concatenating literals in R node by node.
+
+typedef struct {
+    char *data; // From R_alloc(), so released at the end of the call.
+    size_t size;
+    size_t capacity;
+} rmark_text_buffer;
+
+void rmark_text_init(rmark_text_buffer *buf) {
+    buf->capacity = 1024;
+    buf->size = 0;
+    buf->data = R_alloc(buf->capacity, 1);
+}
+
+void rmark_text_append(rmark_text_buffer *buf, const char *string, size_t length) {
+    if (buf->size + length > buf->capacity) {
+        size_t capacity = buf->capacity;
+        while (capacity < buf->size + length)
+            capacity *= 2;
+        buf->data = S_realloc(buf->data, capacity, buf->capacity, 1);
+        buf->capacity = capacity;
     }
-    return Rf_ScalarLogical(ok);
+    memcpy(buf->data + buf->size, string, length);
+    buf->size += length;
 }
 
-SEXP rmark_node_prepend_child(SEXP x, SEXP new) {
-    int ok = cmark_node_prepend_child(NODE(x), NODE(new));
-    if (ok) {
-        rmark_tree_adopt_node(ROOT(x), PTR(new));
+// Add the plain text of an iterator event: the literals of text and code,
+// spaces for soft breaks, and newlines for hard breaks and between blocks.
+// Raw HTML is markup, so it is left out.
+void rmark_text_add_event(rmark_text_buffer *buf, cmark_node *node, cmark_event_type event) {
+    if (event != CMARK_EVENT_ENTER)
+        return;
+    cmark_node_type type = cmark_node_get_type(node);
+    if (type == CMARK_NODE_PARAGRAPH || type == CMARK_NODE_HEADING || type == CMARK_NODE_CODE_BLOCK) {
+        if (buf->size > 0 && buf->data[buf->size - 1] != '\n')
+            rmark_text_append(buf, "\n", 1);
+    }
+    if (type == CMARK_NODE_TEXT || type == CMARK_NODE_CODE || type == CMARK_NODE_CODE_BLOCK) {
+        const char *literal = cmark_node_get_literal(node);
+        if (literal)
+            rmark_text_append(buf, literal, strlen(literal));
+    } else if (type == CMARK_NODE_SOFTBREAK) {
+        rmark_text_append(buf, " ", 1);
+    } else if (type == CMARK_NODE_LINEBREAK) {
+        rmark_text_append(buf, "\n", 1);
     }
-    return Rf_ScalarLogical(ok);
 }
 
-SEXP rmark_node_append_child(SEXP x, SEXP new) {
-    int ok = cmark_node_append_child(NODE(x), NODE(new));
-    if (ok) {
-        rmark_tree_adopt_node(ROOT(x), PTR(new));
+// Make a string of the buffer from `start`, without trailing newlines, such
+// as those ending code blocks.
+SEXP rmark_text_charsxp(rmark_text_buffer *buf, size_t start) {
+    size_t end = buf->size;
+    while (end > start && buf->data[end - 1] == '\n')
+        end--;
+    if (end - start > INT_MAX)
+        Rf_error("The text is too long for an R string.");
+    return Rf_mkCharLenCE(buf->data + start, (int) (end - start), CE_UTF8);
+}
+
+// Allocate a named list of columns with room for `capacity` rows. Resize
+// them with rmark_flat_resize().
+SEXP rmark_make_columns(const char **names, const SEXPTYPE *types, int count, R_xlen_t capacity) {
+    SEXP cols = PROTECT(Rf_allocVector(VECSXP, count));
+    SEXP col_names = PROTECT(Rf_allocVector(STRSXP, count));
+    for (int j = 0; j < count; j++) {
+        SET_VECTOR_ELT(cols, j, Rf_allocVector(types[j], capacity));
+        SET_STRING_ELT(col_names, j, Rf_mkChar(names[j]));
     }
-    return Rf_ScalarLogical(ok);
+    Rf_setAttrib(cols, R_NamesSymbol, col_names);
+    UNPROTECT(2);
+    return cols;
 }
 
-// TODO: Support consolidate text nodes? What if we hold external pointers to them?
+SEXP rmark_plain_text(SEXP x) {
+    cmark_node *top = NODE(x);
+    rmark_text_buffer buf;
+    rmark_text_init(&buf);
 
-/** Parsing */
+    cmark_iter *iter = cmark_iter_new(top);
+    SEXP ptr = PROTECT(R_MakeExternalPtr(iter, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_iter_ptr);
 
-void rmark_finalize_parser_ptr(SEXP x) {
-    cmark_parser_free(R_ExternalPtrAddr(x));
+    cmark_event_type event = {0};
+    while ((event = cmark_iter_next(iter)) != CMARK_EVENT_DONE)
+        rmark_text_add_event(&buf, cmark_iter_get_node(iter), event);
+
+    SEXP result = PROTECT(Rf_ScalarString(rmark_text_charsxp(&buf, 0)));
+    UNPROTECT(2);
+    return result;
 }
 
-SEXP rmark_read_md(SEXP x) {
-#if R_CONNECTIONS_VERSION > 1
-    Rf_error("rmark was built with an unsupported version of the R connections API.");
-#else
-    int options = CMARK_OPT_DEFAULT;
-    Rconnection conn = R_GetConnection(x);
-    cmark_parser *parser = cmark_parser_new(options);
+// Headings with their pre-order ids, as in rmark_flatten(), and plain text.
 
-    // Make sure parser is free'd if there's an error reading from the connection.
-    SEXP ptr = PROTECT(R_MakeExternalPtr(parser, R_NilValue, R_NilValue));
-    R_RegisterCFinalizer(ptr, &rmark_finalize_parser_ptr);
+typedef enum {
+    RMARK_OUTLINE_ID,
+    RMARK_OUTLINE_LEVEL,
+    RMARK_OUTLINE_TEXT,
+    RMARK_OUTLINE_START_LINE,
+    RMARK_OUTLINE_COUNT,
+} rmark_outline_column;
 
-    size_t bytes_read = 0;
-    char *buf = R_alloc(BUFSIZ, sizeof(char));
-    while ((bytes_read = R_ReadConnection(conn, buf, BUFSIZ))) {
-        R_CheckUserInterrupt();
-        cmark_parser_feed(parser, buf, bytes_read);
+const char *rmark_outline_column_names[RMARK_OUTLINE_COUNT] = {
+    "id", "level", "text", "start_line",
+};
+
+SEXPTYPE rmark_outline_column_types[RMARK_OUTLINE_COUNT] = {
+    INTSXP, INTSXP, STRSXP, INTSXP,
+};
+
+SEXP rmark_outline(SEXP x) {
+    cmark_node *top = NODE(x);
+    R_xlen_t capacity = 16, n = 0;
+    SEXP cols = PROTECT(rmark_make_columns(rmark_outline_column_names, rmark_outline_column_types, RMARK_OUTLINE_COUNT, capacity));
+    rmark_text_buffer buf;
+    rmark_text_init(&buf);
+
+    cmark_iter *iter = cmark_iter_new(top);
+    SEXP ptr = PROTECT(R_MakeExternalPtr(iter, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_iter_ptr);
+
+    // Headings can't be nested, so only one is open at a time.
+    int id = 0, heading_id = 0;
+    cmark_event_type event = {0};
+    while ((event = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+        cmark_node *node = cmark_iter_get_node(iter);
+        if (event == CMARK_EVENT_ENTER)
+            id++;
+        if (cmark_node_get_type(node) != CMARK_NODE_HEADING) {
+            if (heading_id)
+                rmark_text_add_event(&buf, node, event);
+            continue;
+        }
+        if (event == CMARK_EVENT_ENTER) {
+            heading_id = id;
+            buf.size = 0;
+            continue;
+        }
+
+        if (n == capacity) {
+            capacity *= 2;
+            rmark_flat_resize(cols, capacity);
+        }
+        INTEGER(VECTOR_ELT(cols, RMARK_OUTLINE_ID))[n] = heading_id;
+        INTEGER(VECTOR_ELT(cols, RMARK_OUTLINE_LEVEL))[n] = cmark_node_get_heading_level(node);
+        SET_STRING_ELT(VECTOR_ELT(cols, RMARK_OUTLINE_TEXT), n, rmark_text_charsxp(&buf, 0));
+        INTEGER(VECTOR_ELT(cols, RMARK_OUTLINE_START_LINE))[n] =
+            rmark_tree_position(ROOT(x), node).start_line;
+        heading_id = 0;
+        n++;
     }
-    cmark_node *root = cmark_parser_finish(parser);
 
-    UNPROTECT(1);
-    return make_r_root(root);
-#endif // R_CONNECTIONS_VERSION
+    rmark_flat_resize(cols, n);
+    UNPROTECT(2);
+    return cols;
 }
 
-SEXP rmark_parse_md(SEXP x) {
-    int options = CMARK_OPT_DEFAULT;
-    const char *input = Rf_translateCharUTF8(STRING_ELT(x, 0));
-    cmark_node *root = cmark_parse_document(input, strlen(input), options);
-    return make_r_root(root);
-}
+// Links and images with their pre-order ids, destinations and plain text.
+// Images can be nested in links, so the text of open ones is tracked with a
+// stack of offsets into the buffer.
 
-/** Rendering */
+typedef enum {
+    RMARK_LINKS_ID,
+    RMARK_LINKS_TYPE,
+    RMARK_LINKS_URL,
+    RMARK_LINKS_TITLE,
+    RMARK_LINKS_TEXT,
+    RMARK_LINKS_COUNT,
+} rmark_links_column;
 
-// TODO: Allow customizing rendering options from R.
+const char *rmark_links_column_names[RMARK_LINKS_COUNT] = {
+    "id", "type", "url", "title", "text",
+};
+
+SEXPTYPE rmark_links_column_types[RMARK_LINKS_COUNT] = {
+    INTSXP, STRSXP, STRSXP, STRSXP, STRSXP,
+};
+
+SEXP rmark_links(SEXP x) {
+    cmark_node *top = NODE(x);
+    R_xlen_t capacity = 64, n = 0;
+    SEXP cols = PROTECT(rmark_make_columns(rmark_links_column_names, rmark_links_column_types, RMARK_LINKS_COUNT, capacity));
+    SEXP link_string = PROTECT(Rf_mkChar("link"));
+    SEXP image_string = PROTECT(Rf_mkChar("image"));
+    rmark_text_buffer buf;
+    rmark_text_init(&buf);
+
+    int stack_capacity = 8, stack_size = 0;
+    R_xlen_t *stack_rows = (R_xlen_t *) R_alloc(stack_capacity, sizeof(R_xlen_t));
+    size_t *stack_starts = (size_t *) R_alloc(stack_capacity, sizeof(size_t));
+
+    cmark_iter *iter = cmark_iter_new(top);
+    SEXP ptr = PROTECT(R_MakeExternalPtr(iter, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_iter_ptr);
+
+    int id = 0;
+    cmark_event_type event = {0};
+    while ((event = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+        cmark_node *node = cmark_iter_get_node(iter);
+        if (event == CMARK_EVENT_ENTER)
+            id++;
+        cmark_node_type type = cmark_node_get_type(node);
+        if (type != CMARK_NODE_LINK && type != CMARK_NODE_IMAGE) {
+            if (stack_size > 0)
+                rmark_text_add_event(&buf, node, event);
+            continue;
+        }
+
+        if (event == CMARK_EVENT_EXIT) {
+            stack_size--;
+            SET_STRING_ELT(VECTOR_ELT(cols, RMARK_LINKS_TEXT), stack_rows[stack_size],
+                rmark_text_charsxp(&buf, stack_starts[stack_size]));
+            if (stack_size == 0)
+                buf.size = 0;
+            continue;
+        }
+
+        if (n == capacity) {
+            capacity *= 2;
+            rmark_flat_resize(cols, capacity);
+        }
+        if (stack_size == stack_capacity) {
+            stack_rows = (R_xlen_t *) S_realloc((char *) stack_rows, 2 * stack_capacity, stack_capacity, sizeof(R_xlen_t));
+            stack_starts = (size_t *) S_realloc((char *) stack_starts, 2 * stack_capacity, stack_capacity, sizeof(size_t));
+            stack_capacity *= 2;
+        }
+        stack_rows[stack_size] = n;
+        stack_starts[stack_size] = buf.size;
+        stack_size++;
+
+        INTEGER(VECTOR_ELT(cols, RMARK_LINKS_ID))[n] = id;
+        SET_STRING_ELT(VECTOR_ELT(cols, RMARK_LINKS_TYPE), n, (type == CMARK_NODE_LINK) ? link_string : image_string);
+        SET_STRING_ELT(VECTOR_ELT(cols, RMARK_LINKS_URL), n, rmark_make_utf8_charsxp_or_na(cmark_node_get_url(node)));
+        SET_STRING_ELT(VECTOR_ELT(cols, RMARK_LINKS_TITLE), n, rmark_make_utf8_charsxp_or_na(cmark_node_get_title(node)));
+        n++;
+    }
+
+    rmark_flat_resize(cols, n);
+    UNPROTECT(4);
+    return cols;
+}
+
+/** Vectorised Accessors */
 
 typedef enum {
-    RMARK_OUTPUT_NONE,
-    RMARK_OUTPUT_COMMONMARK,
-    RMARK_OUTPUT_HTML,
-    RMARK_OUTPUT_LATEX,
-    RMARK_OUTPUT_MAN,
-    RMARK_OUTPUT_XML,
-} rmark_output_format;
+    RMARK_FIELD_NONE,
+    RMARK_FIELD_TYPE,
+    RMARK_FIELD_LITERAL,
+    RMARK_FIELD_HEADING_LEVEL,
+    RMARK_FIELD_LIST_TYPE,
+    RMARK_FIELD_LIST_DELIM,
+    RMARK_FIELD_LIST_START,
+    RMARK_FIELD_LIST_TIGHT,
+    RMARK_FIELD_FENCE_INFO,
+    RMARK_FIELD_URL,
+    RMARK_FIELD_TITLE,
+    RMARK_FIELD_START_LINE,
+    RMARK_FIELD_START_COLUMN,
+    RMARK_FIELD_END_LINE,
+    RMARK_FIELD_END_COLUMN,
+} rmark_node_field;
 
-SEXP rmark_render(SEXP x, SEXP output_format, SEXP output_width) {
-    cmark_node *root = NODE(x);
-    int options = CMARK_OPT_DEFAULT;
-    int width = INTEGER(output_width)[0];
-    rmark_output_format format = INTEGER(output_format)[0];
+// Resolve nodes given either as a list of R nodes, or as ids into the subtree
+// of the node x if ids is not NULL. The result is freed at the end of .Call.
+cmark_node **rmark_resolve_nodes(SEXP x, SEXP ids, R_xlen_t *n) {
+    if (Rf_isNull(ids)) {
+        if (TYPEOF(x) != VECSXP)
+            Rf_error("`x` must be a list of Markdown nodes.");
+        *n = Rf_xlength(x);
+        cmark_node **nodes = (cmark_node **) R_alloc(*n, sizeof(cmark_node *));
+        for (R_xlen_t i = 0; i < *n; i++)
+            nodes[i] = NODE(VECTOR_ELT(x, i));
+        return nodes;
+    }
 
-    char *output = NULL;
-    switch (format) {
-        case RMARK_OUTPUT_COMMONMARK: {
-            output = cmark_render_commonmark(root, options, width);
-        } break;
-        case RMARK_OUTPUT_HTML: {
-            output = cmark_render_html(root, options);
+    *n = Rf_xlength(ids);
+    int max_id = 0;
+    for (R_xlen_t i = 0; i < *n; i++) {
+        int id = INTEGER(ids)[i];
+        if (id == NA_INTEGER || id < 1)
+            Rf_error("`ids` must be positive integers.");
+        if (id > max_id)
+            max_id = id;
+    }
+
+    // Index the subtree up to the largest id we need.
+    cmark_node *top = NODE(x);
+    cmark_node **index = (cmark_node **) R_alloc(max_id, sizeof(cmark_node *));
+    int count = 0;
+    for (cmark_node *node = top; node && count < max_id; node = rmark_preorder_next(node, top))
+        index[count++] = node;
+    if (count < max_id)
+        Rf_error("Node id %d is out of bounds for a tree of %d nodes.", max_id, count);
+
+    cmark_node **nodes = (cmark_node **) R_alloc(*n, sizeof(cmark_node *));
+    for (R_xlen_t i = 0; i < *n; i++)
+        nodes[i] = index[INTEGER(ids)[i] - 1];
+    return nodes;
+}
+
+SEXP rmark_nodes_get(SEXP x, SEXP ids, SEXP field) {
+    R_xlen_t n = 0;
+    cmark_node **nodes = rmark_resolve_nodes(x, ids, &n);
+    rmark_node_field node_field = INTEGER(field)[0];
+
+    SEXP result = R_NilValue;
+    switch (node_field) {
+        case RMARK_FIELD_TYPE:
+        case RMARK_FIELD_LITERAL:
+        case RMARK_FIELD_FENCE_INFO:
+        case RMARK_FIELD_URL:
+        case RMARK_FIELD_TITLE: {
+            result = PROTECT(Rf_allocVector(STRSXP, n));
+            for (R_xlen_t i = 0; i < n; i++) {
+                const char *string = NULL;
+                switch (node_field) {
+                    case RMARK_FIELD_TYPE:       string = cmark_node_get_type_string(nodes[i]); break;
+                    case RMARK_FIELD_LITERAL:    string = cmark_node_get_literal(nodes[i]);     break;
+                    case RMARK_FIELD_FENCE_INFO: string = cmark_node_get_fence_info(nodes[i]);  break;
+                    case RMARK_FIELD_URL:        string = cmark_node_get_url(nodes[i]);         break;
+                    case RMARK_FIELD_TITLE:      string = cmark_node_get_title(nodes[i]);       break;
+                    default: break;
+                }
+                SET_STRING_ELT(result, i, rmark_make_utf8_charsxp_or_na(string));
+            }
         } break;
-        case RMARK_OUTPUT_LATEX: {
-            output = cmark_render_latex(root, options, width);
+        case RMARK_FIELD_LIST_TIGHT: {
+            result = PROTECT(Rf_allocVector(LGLSXP, n));
+            for (R_xlen_t i = 0; i < n; i++) {
+                bool is_list = cmark_node_get_type(nodes[i]) == CMARK_NODE_LIST;
+                LOGICAL(result)[i] = is_list ? cmark_node_get_list_tight(nodes[i]) : NA_LOGICAL;
+            }
         } break;
-        case RMARK_OUTPUT_MAN: {
-            output = cmark_render_man(root, options, width);
+        case RMARK_FIELD_HEADING_LEVEL:
+        case RMARK_FIELD_LIST_TYPE:
+        case RMARK_FIELD_LIST_DELIM:
+        case RMARK_FIELD_LIST_START: {
+            result = PROTECT(Rf_allocVector(INTSXP, n));
+            for (R_xlen_t i = 0; i < n; i++) {
+                int value = 0;
+                switch (node_field) {
+                    case RMARK_FIELD_HEADING_LEVEL: value = cmark_node_get_heading_level(nodes[i]); break;
+                    case RMARK_FIELD_LIST_TYPE:     value = cmark_node_get_list_type(nodes[i]);     break;
+                    case RMARK_FIELD_LIST_DELIM:    value = cmark_node_get_list_delim(nodes[i]);    break;
+                    case RMARK_FIELD_LIST_START:    value = cmark_node_get_list_start(nodes[i]);    break;
+                    default: break;
+                }
+                INTEGER(result)[i] = (value) ? value : NA_INTEGER;
+            }
         } break;
-        case RMARK_OUTPUT_XML: {
-            output = cmark_render_xml(root, options);
+        case RMARK_FIELD_START_LINE:
+        case RMARK_FIELD_START_COLUMN:
+        case RMARK_FIELD_END_LINE:
+        case RMARK_FIELD_END_COLUMN: {
+            result = PROTECT(Rf_allocVector(INTSXP, n));
+            for (R_xlen_t i = 0; i < n; i++) {
+                SEXP root = Rf_isNull(ids) ? ROOT(VECTOR_ELT(x, i)) : ROOT(x);
+                int value = 0;
+                switch (node_field) {
+                    case RMARK_FIELD_START_LINE:   value = rmark_tree_position(root, nodes[i]).start_line; break;
+                    case RMARK_FIELD_START_COLUMN: value = rmark_node_position(nodes[i]).start_column; break;
+                    case RMARK_FIELD_END_LINE:     value = rmark_tree_position(root, nodes[i]).end_line; break;
+                    case RMARK_FIELD_END_COLUMN:   value = rmark_node_position(nodes[i]).end_column; break;
+                    default: break;
+                }
+                INTEGER(result)[i] = value;
+            }
         } break;
         default:
-            Rf_error("Unknown output format: %d.", format);
-    }
-    if (!output) {
-        Rf_error("Failed to render document.");
+            Rf_error("Unknown node field: %d.", node_field);
     }
 
-    SEXP result = PROTECT(Rf_mkStringUTF8(output));
-    free(output);
     UNPROTECT(1);
     return result;
 }
 
+// Check that a node can hold a field before setting any values.
+bool rmark_node_has_field(cmark_node *node, rmark_node_field field, const char **expected) {
+    cmark_node_type type = cmark_node_get_type(node);
+    switch (field) {
+        case RMARK_FIELD_LITERAL:
+            *expected = "a leaf";
+            return rmark_iter_is_leaf(node);
+        case RMARK_FIELD_HEADING_LEVEL:
+            *expected = "a heading";
+            return type == CMARK_NODE_HEADING;
+        case RMARK_FIELD_LIST_TYPE:
+        case RMARK_FIELD_LIST_DELIM:
+        case RMARK_FIELD_LIST_START:
+        case RMARK_FIELD_LIST_TIGHT:
+            *expected = "a list";
+            return type == CMARK_NODE_LIST;
+        case RMARK_FIELD_FENCE_INFO:
+            *expected = "a code block";
+            return type == CMARK_NODE_CODE_BLOCK;
+        case RMARK_FIELD_URL:
+        case RMARK_FIELD_TITLE:
+            *expected = "a link or image";
+            return type == CMARK_NODE_LINK || type == CMARK_NODE_IMAGE;
+        default:
+            *expected = "a settable";
+            return false;
+    }
+}
+
+SEXP rmark_nodes_set(SEXP x, SEXP ids, SEXP field, SEXP value) {
+    R_xlen_t n = 0;
+    cmark_node **nodes = rmark_resolve_nodes(x, ids, &n);
+    rmark_node_field node_field = INTEGER(field)[0];
+
+    R_xlen_t n_value = Rf_xlength(value);
+    if (n_value != n && n_value != 1)
+        Rf_error("`value` must have length 1 or %lld, not %lld.", (long long) n, (long long) n_value);
+
+    for (R_xlen_t i = 0; i < n; i++) {
+        const char *expected = NULL;
+        if (!rmark_node_has_field(nodes[i], node_field, &expected)) {
+            Rf_error("Node %lld must be %s node, not a node of type <%s>.",
+                (long long) i + 1, expected, cmark_node_get_type_string(nodes[i]));
+        }
+    }
+    for (R_xlen_t i = 0; i < n_value; i++) {
+        bool is_na = (TYPEOF(value) == STRSXP && STRING_ELT(value, i) == NA_STRING) ||
+                     (TYPEOF(value) == INTSXP && INTEGER(value)[i] == NA_INTEGER) ||
+                     (TYPEOF(value) == LGLSXP && LOGICAL(value)[i] == NA_LOGICAL);
+        if (is_na)
+            Rf_error("`value` must not contain missing values.");
+    }
+    // Check values against the limits of the cmark setters too, so that an
+    // error leaves all nodes unchanged.
+    for (R_xlen_t i = 0; i < n; i++) {
+        R_xlen_t j = (n_value == 1) ? 0 : i;
+        cmark_node_type type = cmark_node_get_type(nodes[i]);
+        int v = (TYPEOF(value) == INTSXP) ? INTEGER(value)[j] : 0;
+        switch (node_field) {
+            case RMARK_FIELD_LITERAL:
+                if (type == CMARK_NODE_THEMATIC_BREAK || type == CMARK_NODE_SOFTBREAK || type == CMARK_NODE_LINEBREAK) {
+                    Rf_error("Node %lld is a node of type <%s>, which has no literal.",
+                        (long long) i + 1, cmark_node_get_type_string(nodes[i]));
+                }
+                break;
+            case RMARK_FIELD_HEADING_LEVEL:
+                if (v < 1 || v > 6)
+                    Rf_error("Heading levels must be between 1 and 6, not %d.", v);
+                break;
+            case RMARK_FIELD_LIST_TYPE:
+                if (v != CMARK_BULLET_LIST && v != CMARK_ORDERED_LIST)
+                    Rf_error("Unknown list type: %d.", v);
+                break;
+            case RMARK_FIELD_LIST_DELIM:
+                if (v != CMARK_PERIOD_DELIM && v != CMARK_PAREN_DELIM)
+                    Rf_error("Unknown list delimiter: %d.", v);
+                break;
+            case RMARK_FIELD_LIST_START:
+                if (v < 0)
+                    Rf_error("List starts must not be negative, not %d.", v);
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (R_xlen_t i = 0; i < n; i++) {
+        R_xlen_t j = (n_value == 1) ? 0 : i;
+        int ok = 0;
+        switch (node_field) {
+            case RMARK_FIELD_LITERAL:
+                ok = cmark_node_set_literal(nodes[i], Rf_translateCharUTF8(STRING_ELT(value, j)));
+                break;
+            case RMARK_FIELD_FENCE_INFO:
+                ok = cmark_node_set_fence_info(nodes[i], Rf_translateCharUTF8(STRING_ELT(value, j)));
+                break;
+            case RMARK_FIELD_URL:
+                ok = cmark_node_set_url(nodes[i], Rf_translateCharUTF8(STRING_ELT(value, j)));
+                break;
+            case RMARK_FIELD_TITLE:
+                ok = cmark_node_set_title(nodes[i], Rf_translateCharUTF8(STRING_ELT(value, j)));
+                break;
+            case RMARK_FIELD_HEADING_LEVEL:
+                ok = cmark_node_set_heading_level(nodes[i], INTEGER(value)[j]);
+                break;
+            case RMARK_FIELD_LIST_TYPE:
+                ok = cmark_node_set_list_type(nodes[i], INTEGER(value)[j]);
+                break;
+            case RMARK_FIELD_LIST_DELIM:
+                ok = cmark_node_set_list_delim(nodes[i], INTEGER(value)[j]);
+                break;
+            case RMARK_FIELD_LIST_START:
+                ok = cmark_node_set_list_start(nodes[i], INTEGER(value)[j]);
+                break;
+            case RMARK_FIELD_LIST_TIGHT:
+                ok = cmark_node_set_list_tight(nodes[i], LOGICAL(value)[j]);
+                break;
+            default:
+                break;
+        }
+        if (!ok) {
+            Rf_error("Failed to set field of node %lld.", (long long) i + 1);
+        }
+        rmark_tree_touch(Rf_isNull(ids) ? ROOT(VECTOR_ELT(x, i)) : ROOT(x), nodes[i]);
+    }
+
+    return R_NilValue;
+}
+
+/** Selectors */
+
+// A small selector language for finding nodes, modelled after CSS:
+//
+//   heading[level=2] > text, code_block[info^="r"], list item ~ item
+//
+// Compound selectors match a node type (or `*`) and attribute predicates with
+// `=` (equals), `^=` (prefix), `$=` (suffix), `*=` (contains), or no operator
+// (attribute applies to the node). Combinators are ` ` (descendant), `>`
+// (child), `+` (next sibling) and `~` (following sibling). Commas separate
+// alternatives. Selectors are compiled once and matched right-to-left.
+
+typedef enum {
+    RMARK_SELECTOR_OP_EXISTS,
+    RMARK_SELECTOR_OP_EQUALS,
+    RMARK_SELECTOR_OP_PREFIX,
+    RMARK_SELECTOR_OP_SUFFIX,
+    RMARK_SELECTOR_OP_CONTAINS,
+} rmark_selector_op;
+
+typedef struct {
+    rmark_node_field field;
+    rmark_selector_op op;
+    char *value;
+} rmark_selector_predicate;
+
+typedef struct {
+    char combinator; // Relation to the previous compound: ' ', '>', '+' or '~'.
+    cmark_node_type type; // CMARK_NODE_NONE matches any type.
+    rmark_selector_predicate *predicates;
+    int n_predicates;
+} rmark_selector_compound;
+
+typedef struct {
+    rmark_selector_compound *compounds;
+    int n_compounds;
+} rmark_selector_complex;
+
+typedef struct {
+    rmark_selector_complex *alternatives;
+    int n_alternatives;
+} rmark_selector;
+
+const char *rmark_node_type_names[RMARK_NODE_TYPE_COUNT] = {
+    "none", "document", "block_quote", "list", "item", "code_block",
+    "html_block", "custom_block", "paragraph", "heading", "thematic_break",
+    "text", "softbreak", "linebreak", "code", "html_inline", "custom_inline",
+    "emph", "strong", "link", "image",
+};
+
+typedef struct {
+    const char *name;
+    rmark_node_field field;
+} rmark_selector_attribute;
+
+rmark_selector_attribute rmark_selector_attributes[] = {
+    { "level",         RMARK_FIELD_HEADING_LEVEL },
+    { "heading_level", RMARK_FIELD_HEADING_LEVEL },
+    { "list_type",     RMARK_FIELD_LIST_TYPE },
+    { "delim",         RMARK_FIELD_LIST_DELIM },
+    { "list_delim",    RMARK_FIELD_LIST_DELIM },
+    { "start",         RMARK_FIELD_LIST_START },
+    { "list_start",    RMARK_FIELD_LIST_START },
+    { "tight",         RMARK_FIELD_LIST_TIGHT },
+    { "list_tight",    RMARK_FIELD_LIST_TIGHT },
+    { "info",          RMARK_FIELD_FENCE_INFO },
+    { "fence_info",    RMARK_FIELD_FENCE_INFO },
+    { "url",           RMARK_FIELD_URL },
+    { "title",         RMARK_FIELD_TITLE },
+    { "literal",       RMARK_FIELD_LITERAL },
+};
+
+void rmark_selector_free(rmark_selector *selector) {
+    for (int i = 0; i < selector->n_alternatives; i++) {
+        rmark_selector_complex *complex = &selector->alternatives[i];
+        for (int j = 0; j < complex->n_compounds; j++) {
+            rmark_selector_compound *compound = &complex->compounds[j];
+            for (int k = 0; k < compound->n_predicates; k++)
+                R_Free(compound->predicates[k].value);
+            R_Free(compound->predicates);
+        }
+        R_Free(complex->compounds);
+    }
+    R_Free(selector->alternatives);
+    R_Free(selector);
+}
+
+void rmark_finalize_selector_ptr(SEXP x) {
+    rmark_selector *selector = R_ExternalPtrAddr(x);
+    if (selector) {
+        rmark_selector_free(selector);
+        R_ClearExternalPtr(x);
+    }
+}
+
+typedef struct {
+    const char *input;
+    const char *pos;
+} rmark_selector_parser;
+
+void rmark_selector_parse_error(rmark_selector_parser *parser, const char *message) {
+    Rf_error("Invalid selector \"%s\" at position %d: %s.",
+        parser->input, (int)(parser->pos - parser->input) + 1, message);
+}
+
+bool rmark_selector_skip_space(rmark_selector_parser *parser) {
+    const char *start = parser->pos;
+    while (*parser->pos == ' ' || *parser->pos == '\t' || *parser->pos == '\n')
+        parser->pos++;
+    return parser->pos != start;
+}
+
+bool rmark_is_ident_char(char c, bool first) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+        (!first && ((c >= '0' && c <= '9') || c == '-'));
+}
+
+// Parse an identifier into buf, returning false if there isn't one.
+bool rmark_selector_parse_ident(rmark_selector_parser *parser, char *buf, size_t size) {
+    size_t n = 0;
+    if (!rmark_is_ident_char(*parser->pos, true))
+        return false;
+    while (rmark_is_ident_char(*parser->pos, n == 0)) {
+        if (n + 1 >= size)
+            rmark_selector_parse_error(parser, "name is too long");
+        buf[n++] = *parser->pos++;
+    }
+    buf[n] = '\0';
+    return true;
+}
+
+char *rmark_selector_parse_value(rmark_selector_parser *parser) {
+    const char *start = parser->pos, *end = NULL;
+    char quote = *parser->pos;
+    if (quote == '"' || quote == '\'') {
+        start = ++parser->pos;
+        while (*parser->pos && *parser->pos != quote)
+            parser->pos++;
+        if (!*parser->pos)
+            rmark_selector_parse_error(parser, "unterminated string");
+        end = parser->pos++;
+    } else {
+        while (*parser->pos && *parser->pos != ']' && *parser->pos != ' ')
+            parser->pos++;
+        end = parser->pos;
+    }
+    char *value = R_Calloc(end - start + 1, char);
+    memcpy(value, start, end - start);
+    return value;
+}
+
+void rmark_selector_parse_predicate(rmark_selector_parser *parser, rmark_selector_compound *compound) {
+    char name[32];
+    parser->pos++; // Opening bracket.
+    rmark_selector_skip_space(parser);
+    if (!rmark_selector_parse_ident(parser, name, sizeof(name)))
+        rmark_selector_parse_error(parser, "expected attribute name");
+
+    rmark_node_field field = RMARK_FIELD_NONE;
+    int n_attributes = sizeof(rmark_selector_attributes) / sizeof(rmark_selector_attributes[0]);
+    for (int i = 0; i < n_attributes; i++) {
+        if (strcmp(name, rmark_selector_attributes[i].name) == 0)
+            field = rmark_selector_attributes[i].field;
+    }
+    if (field == RMARK_FIELD_NONE)
+        rmark_selector_parse_error(parser, "unknown attribute");
+
+    compound->predicates = R_Realloc(compound->predicates, compound->n_predicates + 1, rmark_selector_predicate);
+    rmark_selector_predicate *predicate = &compound->predicates[compound->n_predicates++];
+    predicate->field = field;
+    predicate->op = RMARK_SELECTOR_OP_EXISTS;
+    predicate->value = NULL;
+
+    rmark_selector_skip_space(parser);
+    switch (*parser->pos) {
+        case '=': predicate->op = RMARK_SELECTOR_OP_EQUALS; break;
+        case '^': predicate->op = RMARK_SELECTOR_OP_PREFIX; break;
+        case '$': predicate->op = RMARK_SELECTOR_OP_SUFFIX; break;
+        case '*': predicate->op = RMARK_SELECTOR_OP_CONTAINS; break;
+        case ']': break;
+        default: rmark_selector_parse_error(parser, "expected operator or ']'");
+    }
+    if (predicate->op != RMARK_SELECTOR_OP_EXISTS) {
+        if (predicate->op != RMARK_SELECTOR_OP_EQUALS && *++parser->pos != '=')
+            rmark_selector_parse_error(parser, "expected '='");
+        parser->pos++;
+        rmark_selector_skip_space(parser);
+        predicate->value = rmark_selector_parse_value(parser);
+        rmark_selector_skip_space(parser);
+    }
+    if (*parser->pos != ']')
+        rmark_selector_parse_error(parser, "expected ']'");
+    parser->pos++;
+}
+
+void rmark_selector_parse_compound(rmark_selector_parser *parser, rmark_selector_complex *complex, char combinator) {
+    complex->compounds = R_Realloc(complex->compounds, complex->n_compounds + 1, rmark_selector_compound);
+    rmark_selector_compound *compound = &complex->compounds[complex->n_compounds++];
+    compound->combinator = combinator;
+    compound->type = CMARK_NODE_NONE;
+    compound->predicates = NULL;
+    compound->n_predicates = 0;
+
+    char name[32];
+    const char *start = parser->pos;
+    if (*parser->pos == '*') {
+        parser->pos++;
+    } else if (rmark_selector_parse_ident(parser, name, sizeof(name))) {
+        for (int type = 1; type < RMARK_NODE_TYPE_COUNT; type++) {
+            if (strcmp(name, rmark_node_type_names[type]) == 0)
+                compound->type = type;
+        }
+        if (compound->type == CMARK_NODE_NONE) {
+            parser->pos = start;
+            rmark_selector_parse_error(parser, "unknown node type");
+        }
+    }
+    while (*parser->pos == '[')
+        rmark_selector_parse_predicate(parser, compound);
+    if (parser->pos == start)
+        rmark_selector_parse_error(parser, "expected node type, '*' or '['");
+}
+
+void rmark_selector_parse(rmark_selector_parser *parser, rmark_selector *selector) {
+    rmark_selector_complex *complex = NULL;
+    char combinator = ' ';
+    bool new_alternative = true;
+
+    rmark_selector_skip_space(parser);
+    for (;;) {
+        if (new_alternative) {
+            selector->alternatives = R_Realloc(selector->alternatives, selector->n_alternatives + 1, rmark_selector_complex);
+            complex = &selector->alternatives[selector->n_alternatives++];
+            complex->compounds = NULL;
+            complex->n_compounds = 0;
+            new_alternative = false;
+        }
+        rmark_selector_parse_compound(parser, complex, combinator);
+
+        bool had_space = rmark_selector_skip_space(parser);
+        char c = *parser->pos;
+        if (c == '\0') {
+            break;
+        } else if (c == ',') {
+            new_alternative = true;
+            combinator = ' ';
+        } else if (c == '>' || c == '+' || c == '~') {
+            combinator = c;
+        } else if (had_space) {
+            combinator = ' ';
+            continue;
+        } else {
+            rmark_selector_parse_error(parser, "unexpected character");
+        }
+        parser->pos++;
+        rmark_selector_skip_space(parser);
+    }
+}
+
+SEXP rmark_selector_compile(SEXP x) {
+    const char *input = Rf_translateCharUTF8(STRING_ELT(x, 0));
+
+    // Register the finalizer first so that partial results are freed on parse errors.
+    SEXP ptr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_selector_ptr);
+    rmark_selector *selector = R_Calloc(1, rmark_selector);
+    R_SetExternalPtrAddr(ptr, selector);
+
+    rmark_selector_parser parser = { input, input };
+    rmark_selector_parse(&parser, selector);
+
+    UNPROTECT(1);
+    return ptr;
+}
+
+// Get an attribute of a node as a string, or NULL if it doesn't apply.
+const char *rmark_node_field_string(cmark_node *node, rmark_node_field field, char *buf, size_t size) {
+    cmark_node_type type = cmark_node_get_type(node);
+    switch (field) {
+        case RMARK_FIELD_LITERAL:    return cmark_node_get_literal(node);
+        case RMARK_FIELD_FENCE_INFO: return (type == CMARK_NODE_CODE_BLOCK) ? cmark_node_get_fence_info(node) : NULL;
+        case RMARK_FIELD_URL:        return cmark_node_get_url(node);
+        case RMARK_FIELD_TITLE:      return cmark_node_get_title(node);
+        case RMARK_FIELD_HEADING_LEVEL: {
+            if (type != CMARK_NODE_HEADING)
+                return NULL;
+            snprintf(buf, size, "%d", cmark_node_get_heading_level(node));
+            return buf;
+        }
+        case RMARK_FIELD_LIST_START: {
+            if (type != CMARK_NODE_LIST)
+                return NULL;
+            snprintf(buf, size, "%d", cmark_node_get_list_start(node));
+            return buf;
+        }
+        case RMARK_FIELD_LIST_TYPE: {
+            if (type != CMARK_NODE_LIST)
+                return NULL;
+            return (cmark_node_get_list_type(node) == CMARK_ORDERED_LIST) ? "ordered" : "bullet";
+        }
+        case RMARK_FIELD_LIST_DELIM: {
+            cmark_delim_type delim = (type == CMARK_NODE_LIST) ? cmark_node_get_list_delim(node) : CMARK_NO_DELIM;
+            return (delim == CMARK_PERIOD_DELIM) ? "period" : (delim == CMARK_PAREN_DELIM) ? "paren" : NULL;
+        }
+        case RMARK_FIELD_LIST_TIGHT: {
+            if (type != CMARK_NODE_LIST)
+                return NULL;
+            return cmark_node_get_list_tight(node) ? "true" : "false";
+        }
+        default:
+            return NULL;
+    }
+}
+
+bool rmark_selector_match_predicate(rmark_selector_predicate *predicate, cmark_node *node) {
+    char buf[32];
+    const char *string = rmark_node_field_string(node, predicate->field, buf, sizeof(buf));
+    if (!string)
+        return false;
+
+    size_t n = strlen(string), m = (predicate->value) ? strlen(predicate->value) : 0;
+    switch (predicate->op) {
+        case RMARK_SELECTOR_OP_EXISTS:   return true;
+        case RMARK_SELECTOR_OP_EQUALS:   return strcmp(string, predicate->value) == 0;
+        case RMARK_SELECTOR_OP_PREFIX:   return n >= m && strncmp(string, predicate->value, m) == 0;
+        case RMARK_SELECTOR_OP_SUFFIX:   return n >= m && strcmp(string + n - m, predicate->value) == 0;
+        case RMARK_SELECTOR_OP_CONTAINS: return strstr(string, predicate->value) != NULL;
+    }
+    return false;
+}
+
+bool rmark_selector_match_compound(rmark_selector_compound *compound, cmark_node *node) {
+    if (compound->type != CMARK_NODE_NONE && cmark_node_get_type(node) != compound->type)
+        return false;
+    for (int i = 0; i < compound->n_predicates; i++) {
+        if (!rmark_selector_match_predicate(&compound->predicates[i], node))
+            return false;
+    }
+    return true;
+}
+
+// Match compounds [0, k] of a complex selector ending at node, without
+// looking outside the subtree of top.
+bool rmark_selector_match_complex(rmark_selector_complex *complex, int k, cmark_node *node, cmark_node *top) {
+    rmark_selector_compound *compound = &complex->compounds[k];
+    if (!rmark_selector_match_compound(compound, node))
+        return false;
+    if (k == 0)
+        return true;
+
+    switch (compound->combinator) {
+        case '>': {
+            cmark_node *parent = (node == top) ? NULL : cmark_node_parent(node);
+            return parent && rmark_selector_match_complex(complex, k - 1, parent, top);
+        }
+        case ' ': {
+            for (cmark_node *ancestor = node; ancestor != top; ) {
+                ancestor = cmark_node_parent(ancestor);
+                if (rmark_selector_match_complex(complex, k - 1, ancestor, top))
+                    return true;
+            }
+            return false;
+        }
+        case '+': {
+            cmark_node *sibling = (node == top) ? NULL : cmark_node_previous(node);
+            return sibling && rmark_selector_match_complex(complex, k - 1, sibling, top);
+        }
+        case '~': {
+            cmark_node *sibling = (node == top) ? NULL : cmark_node_previous(node);
+            for (; sibling; sibling = cmark_node_previous(sibling)) {
+                if (rmark_selector_match_complex(complex, k - 1, sibling, top))
+                    return true;
+            }
+            return false;
+        }
+    }
+    return false;
+}
+
+bool rmark_selector_match(rmark_selector *selector, cmark_node *node, cmark_node *top) {
+    for (int i = 0; i < selector->n_alternatives; i++) {
+        rmark_selector_complex *complex = &selector->alternatives[i];
+        if (rmark_selector_match_complex(complex, complex->n_compounds - 1, node, top))
+            return true;
+    }
+    return false;
+}
+
+SEXP rmark_select(SEXP x, SEXP selector_ptr, SEXP return_ids) {
+    rmark_selector *selector = R_ExternalPtrAddr(selector_ptr);
+    if (!selector)
+        Rf_error("`selector` is no longer valid. Was it saved and reloaded?");
+
+    cmark_node *top = NODE(x);
+    int capacity = 64, n = 0, id = 0;
+    int *ids = (int *) R_alloc(capacity, sizeof(int));
+    cmark_node **nodes = (cmark_node **) R_alloc(capacity, sizeof(cmark_node *));
+    for (cmark_node *node = top; node; node = rmark_preorder_next(node, top)) {
+        id++;
+        if (!rmark_selector_match(selector, node, top))
+            continue;
+        if (n == capacity) {
+            ids = (int *) S_realloc((char *) ids, 2 * capacity, capacity, sizeof(int));
+            nodes = (cmark_node **) S_realloc((char *) nodes, 2 * capacity, capacity, sizeof(cmark_node *));
+            capacity *= 2;
+        }
+        ids[n] = id;
+        nodes[n] = node;
+        n++;
+    }
+
+    SEXP result = R_NilValue;
+    if (LOGICAL(return_ids)[0]) {
+        result = PROTECT(Rf_allocVector(INTSXP, n));
+        memcpy(INTEGER(result), ids, n * sizeof(int));
+    } else {
+        result = PROTECT(Rf_allocVector(VECSXP, n));
+        SEXP root = ROOT(x);
+        for (int i = 0; i < n; i++)
+            SET_VECTOR_ELT(result, i, make_r_node(root, nodes[i]));
+    }
+
+    UNPROTECT(1);
+    return result;
+}
+
+/** Tree Manipulation */
+
+// Move the registered reference of a node between registries, dropping it if stale.
+void rmark_registry_move(SEXP from, SEXP to, SEXP root, cmark_node *node) {
+    int i = rmark_registry_find(REGISTRY(from), node);
+    if (i < 0) {
+        return;
+    }
+    SEXP ref = PROTECT(VECTOR_ELT(REGISTRY_REFS(from), i));
+    SEXP ptr = PROTECT(R_WeakRefKey(ref));
+    rmark_registry_remove(from, node);
+    if (ptr != R_NilValue) {
+        R_SetExternalPtrProtected(ptr, root); // Link reference to new root.
+        rmark_registry_set(to, node, ref);
+    }
+    UNPROTECT(2);
+}
+
+// Move the references to descendants of a node by walking its subtree. Gives
+// up after visiting `budget` nodes, returning false if the walk is incomplete.
+bool rmark_registry_move_subtree(SEXP from, SEXP to, SEXP root, cmark_node *node, int budget) {
+    for (cmark_node *current = node; current; current = rmark_preorder_next(current, node)) {
+        if (budget-- <= 0) {
+            return false;
+        }
+        REGISTRY(to)->adoption_visited++;
+        rmark_registry_move(from, to, root, current);
+    }
+    return true;
+}
+
+// Move the references to descendants of a node by scanning the registry and
+// following the parent chain of each referenced node.
+void rmark_registry_move_scan(SEXP from, SEXP to, SEXP root, cmark_node *node) {
+    rmark_registry *registry = REGISTRY(from);
+    REGISTRY(to)->adoption_scans++;
+    REGISTRY(to)->adoption_visited += registry->capacity;
+
+    // Collect first since moving shuffles the table.
+    PROTECT_INDEX ipx;
+    SEXP adopted_ptrs = R_NilValue; // Empty pairlist.
+    PROTECT_WITH_INDEX(adopted_ptrs, &ipx);
+    for (int i = 0; i < registry->capacity; i++) {
+        if (!registry->keys[i])
+            continue;
+        SEXP ptr = R_WeakRefKey(VECTOR_ELT(REGISTRY_REFS(from), i));
+        if (ptr == R_NilValue)
+            continue; // Stale reference, dropped on the next rehash.
+        for (cmark_node *ancestor = registry->keys[i]; ancestor; ancestor = cmark_node_parent(ancestor)) {
+            if (ancestor == node) {
+                REPROTECT(adopted_ptrs = CONS(ptr, adopted_ptrs), ipx);
+                break;
+            }
+        }
+    }
+
+    for (SEXP cell = adopted_ptrs; cell != R_NilValue; cell = CDR(cell))
+        rmark_registry_move(from, to, root, R_ExternalPtrAddr(CAR(cell)));
+
+    UNPROTECT(1);
+}
+
+// Move a node and all its descendents to a new root. This only moves the R
+// references to ensure GC protection. Used after changing cmark node links.
+//
+// The cost is proportional to the size of the moved subtree, or to the number
+// of references in the old tree if that is smaller. Stale references are not
+// pruned here; the registry drops them when it needs to grow.
+SEXP rmark_tree_adopt_node(SEXP root, SEXP node) {
+    // root == node is used to promote a node to a tree while moving refs from the old root.
+    if (R_ExternalPtrTag(root) != rmark_root_symbol && root != node)
+        Rf_error("internal error: invalid root");
+    if (R_ExternalPtrTag(node) != rmark_root_symbol && R_ExternalPtrTag(node) != rmark_node_symbol)
+        Rf_error("internal error: invalid node");
+
+    SEXP old_root = rmark_node_get_root(node);
+    if (old_root == root) {
+        return R_NilValue;
+    }
+
+    // The node may drop its reference to the old root below.
+    PROTECT(old_root);
+    SEXP old_registry = PROTECT(R_ExternalPtrProtected(old_root));
+    SEXP registry = PROTECT((root == node) ? rmark_registry_new() : R_ExternalPtrProtected(root));
+    cmark_node *adopted_node = R_ExternalPtrAddr(node);
+    REGISTRY(registry)->adoptions++;
+
+    // Line offsets belong to the text of the old tree.
+    if (REGISTRY(old_registry)->line_shifts)
+        rmark_shift_table_drop(REGISTRY(old_registry)->line_shifts, adopted_node);
+
+    if (old_root == node) {
+        // A whole tree is adopted, so every reference moves.
+        rmark_registry *old = REGISTRY(old_registry);
+        REGISTRY(registry)->adoption_visited += old->capacity;
+        for (int i = 0; i < old->capacity; i++) {
+            SEXP ref = VECTOR_ELT(REGISTRY_REFS(old_registry), i);
+            SEXP ptr = PROTECT(old->keys[i] ? R_WeakRefKey(ref) : R_NilValue);
+            if (ptr != R_NilValue) {
+                R_SetExternalPtrProtected(ptr, root);
+                rmark_registry_set(registry, old->keys[i], ref);
+            }
+            UNPROTECT(1);
+        }
+    } else {
+        // Walking a subtree larger than the registry costs more than scanning it.
+        int budget = REGISTRY(old_registry)->count;
+        if (!rmark_registry_move_subtree(old_registry, registry, root, adopted_node, budget))
+            rmark_registry_move_scan(old_registry, registry, root, adopted_node);
+    }
+
+    if (root == node) {
+        R_SetExternalPtrTag(root, rmark_root_symbol);
+        R_SetExternalPtrProtected(root, registry);
+    } else {
+        R_SetExternalPtrProtected(node, root);
+        R_SetExternalPtrTag(node, rmark_node_symbol);
+    }
+
+    UNPROTECT(3);
+    return R_NilValue;
+}
+
+SEXP rmark_node_promote_to_tree(SEXP node) {
+    return rmark_tree_adopt_node(node, node);
+}
+
+SEXP rmark_node_unlink(SEXP x) {
+    rmark_tree_touch(ROOT(x), NODE(x));
+    cmark_node_unlink(NODE(x));
+    rmark_node_promote_to_tree(PTR(x));
+    return R_NilValue;
+}
+
+SEXP rmark_node_insert_before(SEXP x, SEXP new) {
+    rmark_tree_touch(ROOT(new), NODE(new));
+    int ok = cmark_node_insert_before(NODE(x), NODE(new));
+    if (ok) {
+        rmark_tree_adopt_node(ROOT(x), PTR(new));
+        rmark_tree_touch(ROOT(x), NODE(new));
+    }
+    return Rf_ScalarLogical(ok);
+}
+
+SEXP rmark_node_insert_after(SEXP x, SEXP new) {
+    rmark_tree_touch(ROOT(new), NODE(new));
+    int ok = cmark_node_insert_after(NODE(x), NODE(new));
+    if (ok) {
+        rmark_tree_adopt_node(ROOT(x), PTR(new));
+        rmark_tree_touch(ROOT(x), NODE(new));
+    }
+    return Rf_ScalarLogical(ok);
+}
+
+SEXP rmark_node_replace(SEXP x, SEXP new) {
+    SEXP root = ROOT(x);
+    rmark_tree_touch(ROOT(new), NODE(new));
+    rmark_tree_touch(root, NODE(x));
+    int ok = cmark_node_replace(NODE(x), NODE(new));
+    if (ok) {
+        rmark_tree_adopt_node(root, PTR(new));
+        rmark_tree_touch(root, NODE(new));
+        // The replaced node is now unlinked and owns its subtree.
+        rmark_node_promote_to_tree(PTR(x));
+    }
+    return Rf_ScalarLogical(ok);
+}
+
+SEXP rmark_node_prepend_child(SEXP x, SEXP new) {
+    rmark_tree_touch(ROOT(new), NODE(new));
+    int ok = cmark_node_prepend_child(NODE(x), NODE(new));
+    if (ok) {
+        rmark_tree_adopt_node(ROOT(x), PTR(new));
+        rmark_tree_touch(ROOT(x), NODE(new));
+    }
+    return Rf_ScalarLogical(ok);
+}
+
+SEXP rmark_node_append_child(SEXP x, SEXP new) {
+    rmark_tree_touch(ROOT(new), NODE(new));
+    int ok = cmark_node_append_child(NODE(x), NODE(new));
+    if (ok) {
+        rmark_tree_adopt_node(ROOT(x), PTR(new));
+        rmark_tree_touch(ROOT(x), NODE(new));
+    }
+    return Rf_ScalarLogical(ok);
+}
+
+// Adjacent text nodes are merged into the first one, and the rest are free'd.
+// Their wrappers are invalidated and dropped from the registry beforehand,
+// so that they can't dangle or match new nodes allocated at the same address.
+
+void rmark_node_invalidate(SEXP registry, cmark_node *node) {
+    SEXP r_node = rmark_registry_get(registry, node);
+    if (r_node != R_NilValue)
+        R_ClearExternalPtr(PTR(r_node));
+    rmark_registry_remove(registry, node);
+}
+
+SEXP rmark_node_consolidate(SEXP x) {
+    cmark_node *top = NODE(x);
+    SEXP registry = R_ExternalPtrProtected(ROOT(x));
+    int merged = 0;
+
+    // Text siblings of the top node are merged too, even outside its subtree.
+    if (cmark_node_get_type(top) == CMARK_NODE_TEXT) {
+        for (cmark_node *next = cmark_node_next(top);
+             next && cmark_node_get_type(next) == CMARK_NODE_TEXT; next = cmark_node_next(next)) {
+            rmark_node_invalidate(registry, next);
+            merged++;
+        }
+    }
+    for (cmark_node *node = rmark_preorder_next(top, top); node; node = rmark_preorder_next(node, top)) {
+        cmark_node *prev = cmark_node_previous(node);
+        if (cmark_node_get_type(node) == CMARK_NODE_TEXT && prev && cmark_node_get_type(prev) == CMARK_NODE_TEXT) {
+            rmark_node_invalidate(registry, node);
+            merged++;
+        }
+    }
+
+    rmark_tree_touch_subtree(ROOT(x), top);
+    cmark_consolidate_text_nodes(top);
+    return Rf_ScalarInteger(merged);
+}
+
+/** Serialization */
+
+// Trees are serialized as a flat list of nodes in pre-order, each referring
+// to its parent by 1-based index, so they can be loaded without parsing:
+//
+//   header: "RMRK", u8 version, u32 node count
+//   node:   u8 type, u32 parent (0 for the root), i32 x 4 source positions,
+//           then type specific attributes (see rmark_serial_node_size())
+//
+// Integers are little-endian. Strings are a u32 length followed by bytes.
+
+#define RMARK_SERIAL_MAGIC "RMRK"
+#define RMARK_SERIAL_VERSION 1
+#define RMARK_SERIAL_HEADER_SIZE 9
+#define RMARK_SERIAL_NODE_SIZE 21
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t pos;
+} rmark_serial_buffer;
+
+size_t rmark_serial_string_size(const char *string) {
+    return 4 + (string ? strlen(string) : 0);
+}
+
+size_t rmark_serial_node_size(cmark_node *node) {
+    size_t size = RMARK_SERIAL_NODE_SIZE;
+    switch (cmark_node_get_type(node)) {
+    case CMARK_NODE_CODE_BLOCK:
+        size += rmark_serial_string_size(cmark_node_get_fence_info(node));
+        // Fall through
+    case CMARK_NODE_HTML_BLOCK:
+    case CMARK_NODE_TEXT:
+    case CMARK_NODE_CODE:
+    case CMARK_NODE_HTML_INLINE:
+        return size + rmark_serial_string_size(cmark_node_get_literal(node));
+    case CMARK_NODE_HEADING:
+        return size + 1;
+    case CMARK_NODE_LIST:
+        return size + 7;
+    case CMARK_NODE_LINK:
+    case CMARK_NODE_IMAGE:
+        return size + rmark_serial_string_size(cmark_node_get_url(node))
+            + rmark_serial_string_size(cmark_node_get_title(node));
+    case CMARK_NODE_CUSTOM_BLOCK:
+    case CMARK_NODE_CUSTOM_INLINE:
+        return size + rmark_serial_string_size(cmark_node_get_on_enter(node))
+            + rmark_serial_string_size(cmark_node_get_on_exit(node));
+    default:
+        return size;
+    }
+}
+
+void rmark_serial_write_u8(rmark_serial_buffer *buf, int value) {
+    buf->data[buf->pos++] = (unsigned char) value;
+}
+
+void rmark_serial_write_u32(rmark_serial_buffer *buf, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        buf->data[buf->pos++] = (unsigned char) (value >> (8 * i));
+}
+
+void rmark_serial_write_string(rmark_serial_buffer *buf, const char *string) {
+    size_t length = string ? strlen(string) : 0;
+    rmark_serial_write_u32(buf, (uint32_t) length);
+    if (length)
+        memcpy(buf->data + buf->pos, string, length);
+    buf->pos += length;
+}
+
+void rmark_serial_write_node(rmark_serial_buffer *buf, cmark_node *node, uint32_t parent, rmark_position position) {
+    rmark_serial_write_u8(buf, cmark_node_get_type(node));
+    rmark_serial_write_u32(buf, parent);
+    rmark_serial_write_u32(buf, (uint32_t) position.start_line);
+    rmark_serial_write_u32(buf, (uint32_t) position.start_column);
+    rmark_serial_write_u32(buf, (uint32_t) position.end_line);
+    rmark_serial_write_u32(buf, (uint32_t) position.end_column);
+    switch (cmark_node_get_type(node)) {
+    case CMARK_NODE_CODE_BLOCK:
+        rmark_serial_write_string(buf, cmark_node_get_fence_info(node));
+        // Fall through
+    case CMARK_NODE_HTML_BLOCK:
+    case CMARK_NODE_TEXT:
+    case CMARK_NODE_CODE:
+    case CMARK_NODE_HTML_INLINE:
+        rmark_serial_write_string(buf, cmark_node_get_literal(node));
+        break;
+    case CMARK_NODE_HEADING:
+        rmark_serial_write_u8(buf, cmark_node_get_heading_level(node));
+        break;
+    case CMARK_NODE_LIST:
+        rmark_serial_write_u8(buf, cmark_node_get_list_type(node));
+        rmark_serial_write_u8(buf, cmark_node_get_list_delim(node));
+        rmark_serial_write_u32(buf, (uint32_t) cmark_node_get_list_start(node));
+        rmark_serial_write_u8(buf, cmark_node_get_list_tight(node));
+        break;
+    case CMARK_NODE_LINK:
+    case CMARK_NODE_IMAGE:
+        rmark_serial_write_string(buf, cmark_node_get_url(node));
+        rmark_serial_write_string(buf, cmark_node_get_title(node));
+        break;
+    case CMARK_NODE_CUSTOM_BLOCK:
+    case CMARK_NODE_CUSTOM_INLINE:
+        rmark_serial_write_string(buf, cmark_node_get_on_enter(node));
+        rmark_serial_write_string(buf, cmark_node_get_on_exit(node));
+        break;
+    default:
+        break;
+    }
+}
+
+// Serialize the subtree of a node in the tree of `root` into a raw vector,
+// sized in a first pass. Line offsets of the tree are baked into positions.
+SEXP rmark_serialize_tree(SEXP root, cmark_node *top) {
+    size_t size = RMARK_SERIAL_HEADER_SIZE;
+    uint32_t count = 0;
+    for (cmark_node *node = top; node; node = rmark_preorder_next(node, top)) {
+        size += rmark_serial_node_size(node);
+        if (++count == UINT32_MAX)
+            Rf_error("Tree is too large to serialize.");
+    }
+
+    SEXP out = PROTECT(Rf_allocVector(RAWSXP, size));
+    rmark_serial_buffer buf = { RAW(out), size, 0 };
+    memcpy(buf.data, RMARK_SERIAL_MAGIC, 4);
+    buf.pos = 4;
+    rmark_serial_write_u8(&buf, RMARK_SERIAL_VERSION);
+    rmark_serial_write_u32(&buf, count);
+
+    // Stack of indices of open ancestors to find parents.
+    uint32_t *stack = (uint32_t *) R_alloc(count, sizeof(uint32_t));
+    int depth = 0;
+    uint32_t index = 0;
+    cmark_iter *iter = cmark_iter_new(top);
+    cmark_event_type event;
+    while ((event = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+        cmark_node *node = cmark_iter_get_node(iter);
+        if (event == CMARK_EVENT_EXIT) {
+            depth--;
+            continue;
+        }
+        rmark_serial_write_node(&buf, node, depth ? stack[depth - 1] : 0, rmark_tree_position(root, node));
+        index++;
+        if (!rmark_iter_is_leaf(node))
+            stack[depth++] = index;
+    }
+    cmark_iter_free(iter);
+
+    UNPROTECT(1);
+    return out;
+}
+
+bool rmark_serial_read_u8(rmark_serial_buffer *buf, int *value) {
+    if (buf->size - buf->pos < 1)
+        return false;
+    *value = buf->data[buf->pos++];
+    return true;
+}
+
+bool rmark_serial_read_u32(rmark_serial_buffer *buf, uint32_t *value) {
+    if (buf->size - buf->pos < 4)
+        return false;
+    *value = 0;
+    for (int i = 0; i < 4; i++)
+        *value |= (uint32_t) buf->data[buf->pos++] << (8 * i);
+    return true;
+}
+
+// Read a string into scratch, which must be able to hold the whole buffer.
+bool rmark_serial_read_string(rmark_serial_buffer *buf, char *scratch) {
+    uint32_t length;
+    if (!rmark_serial_read_u32(buf, &length) || buf->size - buf->pos < length)
+        return false;
+    memcpy(scratch, buf->data + buf->pos, length);
+    scratch[length] = '\0';
+    buf->pos += length;
+    return true;
+}
+
+bool rmark_serial_read_attributes(rmark_serial_buffer *buf, cmark_node *node, char *scratch) {
+    int ok = 1, u8;
+    uint32_t u32;
+    switch (cmark_node_get_type(node)) {
+    case CMARK_NODE_CODE_BLOCK:
+        if (!rmark_serial_read_string(buf, scratch))
+            return false;
+        ok &= cmark_node_set_fence_info(node, scratch);
+        // Fall through
+    case CMARK_NODE_HTML_BLOCK:
+    case CMARK_NODE_TEXT:
+    case CMARK_NODE_CODE:
+    case CMARK_NODE_HTML_INLINE:
+        if (!rmark_serial_read_string(buf, scratch))
+            return false;
+        return ok & cmark_node_set_literal(node, scratch);
+    case CMARK_NODE_HEADING:
+        return rmark_serial_read_u8(buf, &u8) && cmark_node_set_heading_level(node, u8);
+    case CMARK_NODE_LIST:
+        if (!rmark_serial_read_u8(buf, &u8) || !cmark_node_set_list_type(node, u8))
+            return false;
+        // Bullet lists carry no delimiter, and cmark rejects setting one.
+        if (!rmark_serial_read_u8(buf, &u8) || (u8 != CMARK_NO_DELIM && !cmark_node_set_list_delim(node, u8)))
+            return false;
+        if (!rmark_serial_read_u32(buf, &u32) || !cmark_node_set_list_start(node, (int) u32))
+            return false;
+        return rmark_serial_read_u8(buf, &u8) && cmark_node_set_list_tight(node, u8);
+    case CMARK_NODE_LINK:
+    case CMARK_NODE_IMAGE:
+        if (!rmark_serial_read_string(buf, scratch) || !cmark_node_set_url(node, scratch))
+            return false;
+        return rmark_serial_read_string(buf, scratch) && cmark_node_set_title(node, scratch);
+    case CMARK_NODE_CUSTOM_BLOCK:
+    case CMARK_NODE_CUSTOM_INLINE:
+        if (!rmark_serial_read_string(buf, scratch) || !cmark_node_set_on_enter(node, scratch))
+            return false;
+        return rmark_serial_read_string(buf, scratch) && cmark_node_set_on_exit(node, scratch);
+    default:
+        return true;
+    }
+}
+
+// Load a serialized tree, returning its root R node. Nodes are appended to
+// the root as they are read, so they get free'd with it on errors. If nodes
+// is not NULL, it gets an array of all nodes in pre-order.
+SEXP rmark_unserialize_tree(const unsigned char *data, size_t size, cmark_node ***nodes_out, uint32_t *n_out) {
+    rmark_serial_buffer buf = { (unsigned char *) data, size, 0 };
+    int version;
+    uint32_t n;
+    if (size < RMARK_SERIAL_HEADER_SIZE || memcmp(data, RMARK_SERIAL_MAGIC, 4) != 0)
+        Rf_error("Input is not a serialized markdown tree.");
+    buf.pos = 4;
+    rmark_serial_read_u8(&buf, &version);
+    rmark_serial_read_u32(&buf, &n);
+    if (version != RMARK_SERIAL_VERSION)
+        Rf_error("Unsupported serialization format version %d.", version);
+    if (n == 0 || n > (size - buf.pos) / RMARK_SERIAL_NODE_SIZE)
+        Rf_error("Serialized tree is truncated.");
+
+    cmark_node **nodes = (cmark_node **) R_alloc(n, sizeof(cmark_node *));
+    char *scratch = R_alloc(size + 1, 1);
+    SEXP r_root = R_NilValue;
+    for (uint32_t i = 0; i < n; i++) {
+        int type;
+        uint32_t parent, lines[4];
+        if (!rmark_serial_read_u8(&buf, &type) || !rmark_serial_read_u32(&buf, &parent))
+            Rf_error("Serialized tree is truncated.");
+        if (type <= CMARK_NODE_NONE || type > CMARK_NODE_LAST_INLINE)
+            Rf_error("Serialized node %u has an unknown type.", i + 1);
+        if ((i == 0) != (parent == 0) || parent > i)
+            Rf_error("Serialized node %u has an invalid parent.", i + 1);
+
+        for (int j = 0; j < 4; j++)
+            if (!rmark_serial_read_u32(&buf, &lines[j]))
+                Rf_error("Serialized tree is truncated.");
+
+        cmark_node *node = cmark_node_new_with_mem(type, &rmark_mem);
+        nodes[i] = node;
+        if (i == 0) {
+            r_root = PROTECT(make_r_root(node));
+        } else if (!cmark_node_append_child(nodes[parent - 1], node)) {
+            cmark_node_free(node);
+            Rf_error("Serialized node %u can't be a child of its parent.", i + 1);
+        }
+        rmark_position_set(node, (rmark_position) { (int) lines[0], (int) lines[1], (int) lines[2], (int) lines[3] });
+        if (!rmark_serial_read_attributes(&buf, node, scratch))
+            Rf_error("Serialized node %u has invalid attributes.", i + 1);
+    }
+    if (buf.pos != size)
+        Rf_error("Serialized tree has trailing data.");
+
+    if (nodes_out) {
+        *nodes_out = nodes;
+        *n_out = n;
+    }
+    UNPROTECT(1);
+    return r_root;
+}
+
+SEXP rmark_serialize(SEXP x) {
+    return rmark_serialize_tree(ROOT(x), NODE(x));
+}
+
+SEXP rmark_unserialize(SEXP x) {
+    if (TYPEOF(x) != RAWSXP)
+        Rf_error("`x` must be a raw vector, not <%s>.", Rf_type2char(TYPEOF(x)));
+    return rmark_unserialize_tree(RAW(x), XLENGTH(x), NULL, NULL);
+}
+
+// Hooks for R serialization. External pointers of nodes are written as a
+// character vector: "rmark", the pre-order id of the node in its tree, and
+// the tree serialized as base64. Hooks made for a session add the session
+// token and the index of the tree in the session, and leave out trees they
+// already wrote, so that nodes of one tree are restored into one tree. Other
+// references are left to R.
+
+typedef struct {
+    uint64_t token; // Tells streams written by different sessions apart.
+    int count; // Trees written or read.
+} rmark_serial_session;
+
+#define RMARK_BASE64_DIGITS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+
+char *rmark_base64_encode(const unsigned char *data, size_t size) {
+    const char *digits = RMARK_BASE64_DIGITS;
+    char *out = R_alloc(4 * ((size + 2) / 3) + 1, 1), *p = out;
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t group = (uint32_t) data[i] << 16;
+        if (i + 1 < size) group |= (uint32_t) data[i + 1] << 8;
+        if (i + 2 < size) group |= data[i + 2];
+        *p++ = digits[group >> 18 & 63];
+        *p++ = digits[group >> 12 & 63];
+        *p++ = (i + 1 < size) ? digits[group >> 6 & 63] : '=';
+        *p++ = (i + 2 < size) ? digits[group & 63] : '=';
+    }
+    *p = '\0';
+    return out;
+}
+
+// Decode base64 text, or return NULL if it's malformed.
+unsigned char *rmark_base64_decode(const char *text, size_t *size) {
+    size_t length = strlen(text);
+    if (length % 4 != 0)
+        return NULL;
+    unsigned char *out = (unsigned char *) R_alloc(length / 4 * 3 + 1, 1);
+    size_t n = 0;
+    for (size_t i = 0; i < length; i += 4) {
+        uint32_t group = 0;
+        int padding = 0;
+        for (int j = 0; j < 4; j++) {
+            const char *digit = (text[i + j] == '=') ? NULL : strchr(RMARK_BASE64_DIGITS, text[i + j]);
+            if (text[i + j] == '=' && i + 4 == length && j >= 2) {
+                padding++;
+            } else if (!digit || padding) {
+                return NULL;
+            }
+            group = group << 6 | (digit ? (uint32_t) (digit - RMARK_BASE64_DIGITS) : 0);
+        }
+        out[n++] = (unsigned char) (group >> 16);
+        if (padding < 2) out[n++] = (unsigned char) (group >> 8);
+        if (padding < 1) out[n++] = (unsigned char) group;
+    }
+    *size = n;
+    return out;
+}
+
+void rmark_finalize_session_ptr(SEXP x) {
+    rmark_serial_session *session = R_ExternalPtrAddr(x);
+    if (session) {
+        R_Free(session);
+        R_ClearExternalPtr(x);
+    }
+}
+
+// Sessions keep the roots of the trees they read in their protected slot.
+SEXP rmark_serial_session_new(void) {
+    SEXP ptr = PROTECT(R_MakeExternalPtr(NULL, rmark_session_symbol, Rf_allocVector(VECSXP, 0)));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_session_ptr);
+    rmark_serial_session *session = R_Calloc(1, rmark_serial_session);
+    R_SetExternalPtrAddr(ptr, session);
+    // Unique enough to tell sessions apart, without touching R's RNG. Zero
+    // is the session of trees that were never written.
+    static uint64_t sessions = 0;
+    session->token = (uint64_t) time(NULL) * 0x9e3779b97f4a7c15ULL ^ (uint64_t) (rmark_now() * 1e9)
+        ^ (uint64_t) (uintptr_t) session ^ ++sessions << 48;
+    if (session->token == 0)
+        session->token = 1;
+    UNPROTECT(1);
+    return ptr;
+}
+
+rmark_serial_session *rmark_serial_session_get(SEXP x) {
+    if (TYPEOF(x) != EXTPTRSXP || R_ExternalPtrTag(x) != rmark_session_symbol)
+        Rf_error("`session` must be a serialization session.");
+    rmark_serial_session *session = R_ExternalPtrAddr(x);
+    if (!session)
+        Rf_error("`session` is no longer valid.");
+    return session;
+}
+
+SEXP rmark_serialize_hook(SEXP x, SEXP session_ptr) {
+    if (TYPEOF(x) != EXTPTRSXP || !HAS_RMARK_TAG(x) || !R_ExternalPtrAddr(x))
+        return R_NilValue;
+    rmark_serial_session *session = Rf_isNull(session_ptr) ? NULL : rmark_serial_session_get(session_ptr);
+
+    SEXP root = rmark_node_get_root(x);
+    cmark_node *node = R_ExternalPtrAddr(x), *top = node;
+    while (cmark_node_parent(top))
+        top = cmark_node_parent(top);
+    int id = 1;
+    for (cmark_node *it = top; it != node; it = rmark_preorder_next(it, top))
+        id++;
+
+    // The registry of a tree remembers the last session that wrote it.
+    rmark_registry *registry = REGISTRY(R_ExternalPtrProtected(root));
+    bool written = session && registry->serial_session == session->token;
+    if (session && !written) {
+        registry->serial_session = session->token;
+        registry->serial_index = ++session->count;
+    }
+
+    const char *data = "";
+    if (!written) {
+        SEXP raw = PROTECT(rmark_serialize_tree(root, top));
+        if (XLENGTH(raw) > (R_LEN_T_MAX - 4) / 4 * 3)
+            Rf_error("Tree is too large to serialize with R.");
+        data = rmark_base64_encode(RAW(raw), XLENGTH(raw));
+        UNPROTECT(1);
+    }
+
+    char string[32];
+    SEXP out = PROTECT(Rf_allocVector(STRSXP, session ? 5 : 3));
+    SET_STRING_ELT(out, 0, Rf_mkChar("rmark"));
+    snprintf(string, sizeof(string), "%d", id);
+    SET_STRING_ELT(out, 1, Rf_mkChar(string));
+    SET_STRING_ELT(out, 2, Rf_mkChar(data));
+    if (session) {
+        snprintf(string, sizeof(string), "%016llx", (unsigned long long) session->token);
+        SET_STRING_ELT(out, 3, Rf_mkChar(string));
+        snprintf(string, sizeof(string), "%d", registry->serial_index);
+        SET_STRING_ELT(out, 4, Rf_mkChar(string));
+    }
+    UNPROTECT(1);
+    return out;
+}
+
+SEXP rmark_unserialize_hook(SEXP x, SEXP session_ptr) {
+    if (TYPEOF(x) != STRSXP || (XLENGTH(x) != 3 && XLENGTH(x) != 5) || strcmp(CHAR(STRING_ELT(x, 0)), "rmark") != 0)
+        Rf_error("Can't restore an unknown reference.");
+    rmark_serial_session *session = Rf_isNull(session_ptr) ? NULL : rmark_serial_session_get(session_ptr);
+
+    int id = atoi(CHAR(STRING_ELT(x, 1)));
+    const char *data = CHAR(STRING_ELT(x, 2));
+    uint64_t token = 0;
+    int index = 0;
+    if (XLENGTH(x) == 5) {
+        token = strtoull(CHAR(STRING_ELT(x, 3)), NULL, 16);
+        index = atoi(CHAR(STRING_ELT(x, 4)));
+    }
+
+    // Trees read by a session are kept by their index in the writing session.
+    // A new token means a new stream, so trees from earlier ones are dropped.
+    SEXP roots = session ? R_ExternalPtrProtected(session_ptr) : R_NilValue;
+    if (session && index > 0 && token != session->token) {
+        session->token = token;
+        roots = Rf_allocVector(VECSXP, 0);
+        R_SetExternalPtrProtected(session_ptr, roots);
+    }
+
+    SEXP r_root;
+    if (*data) {
+        size_t size;
+        unsigned char *bytes = rmark_base64_decode(data, &size);
+        if (!bytes)
+            Rf_error("Serialized tree is corrupted.");
+        r_root = PROTECT(rmark_unserialize_tree(bytes, size, NULL, NULL));
+        if (session && index > 0) {
+            if (index > XLENGTH(roots)) {
+                R_xlen_t capacity = 2 * XLENGTH(roots) > index ? 2 * XLENGTH(roots) : index;
+                roots = Rf_xlengthgets(roots, capacity);
+                R_SetExternalPtrProtected(session_ptr, roots);
+            }
+            SET_VECTOR_ELT(roots, index - 1, r_root);
+        }
+    } else if (!session) {
+        Rf_error("Serialized node refers to a tree written earlier. Read it with a hook made by `md_unserialize_hook()`.");
+    } else if (index < 1 || index > XLENGTH(roots) || Rf_isNull(VECTOR_ELT(roots, index - 1))) {
+        Rf_error("Serialized node refers to a tree that wasn't read. Use a new hook for every call to `serialize()`.");
+    } else {
+        r_root = PROTECT(VECTOR_ELT(roots, index - 1));
+    }
+
+    cmark_node *top = NODE(r_root), *node = top;
+    for (int i = 1; node && i < id; i++)
+        node = rmark_preorder_next(node, top);
+    if (id < 1 || !node)
+        Rf_error("Serialized node id %d is out of bounds.", id);
+    SEXP r_node = make_r_node(PTR(r_root), node);
+    UNPROTECT(1);
+    return PTR(r_node);
+}
+
+/** Parse Cache */
+
+// An optional cache of parsed documents, keyed by a hash of the input bytes
+// and the parser options. Entries keep a copy of the input to rule out hash
+// collisions, and a tree that is cloned for every hit, so callers are free
+// to modify what they get. Clones keep source positions, so hits look like
+// fresh parses. When the cache grows past its byte limit, the least recently
+// used entries are evicted. Sizes are estimates, since cmark doesn't report
+// the memory used by trees. Only used from the main thread.
+
+#define RMARK_CACHE_NODE_SIZE 128
+
+typedef struct rmark_cache_entry {
+    uint64_t hash;
+    int options;
+    size_t length;
+    char *input;
+    cmark_node *root;
+    size_t size;
+    struct rmark_cache_entry *chain; // Next entry in the same bucket.
+    struct rmark_cache_entry *newer, *older;
+} rmark_cache_entry;
+
+typedef struct {
+    rmark_cache_entry **buckets;
+    size_t n_buckets;
+    size_t count;
+    size_t size;
+    size_t limit;
+    rmark_cache_entry *newest, *oldest;
+    double hits, misses, evictions;
+} rmark_cache;
+
+rmark_cache rmark_parse_cache = { NULL, 0, 0, 0, 0, NULL, NULL, 0, 0, 0 };
+
+// 64-bit FNV-1a.
+uint64_t rmark_cache_hash(const char *data, size_t length, int options) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (uint64_t) (unsigned) options;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+bool rmark_cache_enabled(void) {
+    return rmark_parse_cache.limit > 0;
+}
+
+void rmark_cache_unlink_lru(rmark_cache_entry *entry) {
+    rmark_cache *cache = &rmark_parse_cache;
+    if (entry->newer) entry->newer->older = entry->older; else cache->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer; else cache->oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+void rmark_cache_push_lru(rmark_cache_entry *entry) {
+    rmark_cache *cache = &rmark_parse_cache;
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest) cache->newest->newer = entry; else cache->oldest = entry;
+    cache->newest = entry;
+}
+
+void rmark_cache_remove(rmark_cache_entry *entry) {
+    rmark_cache *cache = &rmark_parse_cache;
+    rmark_cache_entry **link = &cache->buckets[entry->hash & (cache->n_buckets - 1)];
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+    rmark_cache_unlink_lru(entry);
+    cache->count--;
+    cache->size -= entry->size;
+    cmark_node_free(entry->root);
+    free(entry->input);
+    free(entry);
+}
+
+void rmark_cache_evict(size_t limit) {
+    rmark_cache *cache = &rmark_parse_cache;
+    while (cache->oldest && cache->size > limit) {
+        rmark_cache_remove(cache->oldest);
+        cache->evictions++;
+    }
+}
+
+// Get a copy of the cached tree for an input, or NULL if there isn't one.
+cmark_node *rmark_cache_lookup(uint64_t hash, const char *data, size_t length, int options) {
+    rmark_cache *cache = &rmark_parse_cache;
+    rmark_cache_entry *entry = cache->n_buckets ? cache->buckets[hash & (cache->n_buckets - 1)] : NULL;
+    for (; entry; entry = entry->chain) {
+        if (entry->hash == hash && entry->options == options && entry->length == length &&
+            (length == 0 || memcmp(entry->input, data, length) == 0)) {
+            rmark_cache_unlink_lru(entry);
+            rmark_cache_push_lru(entry);
+            cache->hits++;
+            return rmark_tree_clone(R_NilValue, entry->root);
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+bool rmark_cache_grow(void) {
+    rmark_cache *cache = &rmark_parse_cache;
+    size_t n_buckets = cache->n_buckets ? 2 * cache->n_buckets : 64;
+    rmark_cache_entry **buckets = calloc(n_buckets, sizeof(rmark_cache_entry *));
+    if (!buckets)
+        return false;
+    for (size_t i = 0; i < cache->n_buckets; i++) {
+        rmark_cache_entry *entry = cache->buckets[i];
+        while (entry) {
+            rmark_cache_entry *chain = entry->chain;
+            entry->chain = buckets[entry->hash & (n_buckets - 1)];
+            buckets[entry->hash & (n_buckets - 1)] = entry;
+            entry = chain;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->n_buckets = n_buckets;
+    return true;
+}
+
+// Store a copy of a freshly parsed tree. Silently gives up if the entry
+// doesn't fit in the cache or memory runs out.
+void rmark_cache_insert(uint64_t hash, const char *data, size_t length, int options, cmark_node *root) {
+    rmark_cache *cache = &rmark_parse_cache;
+    size_t nodes = 0;
+    for (cmark_node *node = root; node; node = rmark_preorder_next(node, root))
+        nodes++;
+    size_t size = sizeof(rmark_cache_entry) + 2 * length + nodes * RMARK_CACHE_NODE_SIZE;
+    if (size > cache->limit)
+        return;
+    if (cache->count >= cache->n_buckets && !rmark_cache_grow())
+        return;
+
+    rmark_cache_entry *entry = calloc(1, sizeof(rmark_cache_entry));
+    char *input = malloc(length ? length : 1);
+    if (!entry || !input) {
+        free(entry);
+        free(input);
+        return;
+    }
+    if (length)
+        memcpy(input, data, length);
+    rmark_cache_evict(cache->limit - size);
+
+    entry->hash = hash;
+    entry->options = options;
+    entry->length = length;
+    entry->input = input;
+    entry->root = rmark_tree_clone(R_NilValue, root);
+    entry->size = size;
+    entry->chain = cache->buckets[entry->hash & (cache->n_buckets - 1)];
+    cache->buckets[entry->hash & (cache->n_buckets - 1)] = entry;
+    rmark_cache_push_lru(entry);
+    cache->count++;
+    cache->size += size;
+}
+
+// Parse contiguous input, going through the cache if it's enabled.
+cmark_node *rmark_parse_cached(const char *data, size_t length, int options, bool use_arena) {
+    if (!rmark_cache_enabled())
+        return rmark_parse_document_arena(data, length, options, use_arena);
+    uint64_t hash = rmark_cache_hash(data, length, options);
+    cmark_node *root = rmark_cache_lookup(hash, data, length, options);
+    if (!root) {
+        root = rmark_parse_document_arena(data, length, options, use_arena);
+        rmark_cache_insert(hash, data, length, options, root);
+    }
+    return root;
+}
+
+SEXP rmark_cache_set_limit(SEXP limit) {
+    double value = Rf_asReal(limit);
+    if (ISNAN(value) || value < 0)
+        Rf_error("`limit` must be a non-negative number of bytes.");
+    SEXP old = PROTECT(Rf_ScalarReal((double) rmark_parse_cache.limit));
+    rmark_parse_cache.limit = (value >= (double) SIZE_MAX) ? SIZE_MAX : (size_t) value;
+    rmark_cache_evict(rmark_parse_cache.limit);
+    UNPROTECT(1);
+    return old;
+}
+
+SEXP rmark_cache_clear(void) {
+    rmark_cache_evict(0);
+    rmark_parse_cache.hits = rmark_parse_cache.misses = rmark_parse_cache.evictions = 0;
+    return R_NilValue;
+}
+
+SEXP rmark_cache_info(void) {
+    const char *names[] = { "entries", "size", "limit", "hits", "misses", "evictions", "" };
+    SEXP out = PROTECT(Rf_mkNamed(VECSXP, names));
+    SET_VECTOR_ELT(out, 0, Rf_ScalarReal((double) rmark_parse_cache.count));
+    SET_VECTOR_ELT(out, 1, Rf_ScalarReal((double) rmark_parse_cache.size));
+    SET_VECTOR_ELT(out, 2, Rf_ScalarReal((double) rmark_parse_cache.limit));
+    SET_VECTOR_ELT(out, 3, Rf_ScalarReal(rmark_parse_cache.hits));
+    SET_VECTOR_ELT(out, 4, Rf_ScalarReal(rmark_parse_cache.misses));
+    SET_VECTOR_ELT(out, 5, Rf_ScalarReal(rmark_parse_cache.evictions));
+    UNPROTECT(1);
+    return out;
+}
+
+/** Parsing */
+
+void rmark_finalize_parser_ptr(SEXP x) {
+    cmark_parser *parser = R_ExternalPtrAddr(x);
+    if (parser) {
+        cmark_parser_free(parser);
+        R_ClearExternalPtr(x);
+    }
+}
+
+SEXP rmark_read_md(SEXP x, SEXP arena) {
+#if R_CONNECTIONS_VERSION > 1
+    Rf_error("rmark was built with an unsupported version of the R connections API.");
+#else
+    double start = rmark_now();
+    int options = CMARK_OPT_DEFAULT;
+    Rconnection conn = R_GetConnection(x);
+    bool use_arena = Rf_asLogical(arena) == TRUE;
+
+    // The cache needs the whole input up front to look it up, and arenas need
+    // it to parse without calling back into R.
+    if (rmark_cache_enabled() || use_arena) {
+        size_t capacity = BUFSIZ, length = 0, bytes_read = 0;
+        PROTECT_INDEX ipx;
+        SEXP input = R_NilValue;
+        PROTECT_WITH_INDEX(input = Rf_allocVector(RAWSXP, capacity), &ipx);
+        while ((bytes_read = R_ReadConnection(conn, RAW(input) + length, capacity - length))) {
+            R_CheckUserInterrupt();
+            length += bytes_read;
+            if (length == capacity) {
+                capacity *= 2;
+                REPROTECT(input = Rf_xlengthgets(input, capacity), ipx);
+            }
+        }
+        cmark_node *root = rmark_parse_cached((const char *) RAW(input), length, options, use_arena);
+        rmark_stats_parsed(start, 1);
+        UNPROTECT(1);
+        return make_r_root(root);
+    }
+
+    cmark_parser *parser = cmark_parser_new_with_mem(options, &rmark_mem);
+
+    // Make sure parser is free'd if there's an error reading from the connection.
+    SEXP ptr = PROTECT(R_MakeExternalPtr(parser, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_parser_ptr);
+
+    size_t bytes_read = 0;
+    char *buf = R_alloc(BUFSIZ, sizeof(char));
+    while ((bytes_read = R_ReadConnection(conn, buf, BUFSIZ))) {
+        R_CheckUserInterrupt();
+        cmark_parser_feed(parser, buf, bytes_read);
+    }
+    cmark_node *root = cmark_parser_finish(parser);
+    rmark_stats_parsed(start, 1);
+
+    UNPROTECT(1);
+    return make_r_root(root);
+#endif // R_CONNECTIONS_VERSION
+}
+
+// Fast path for plain local files: map the file into memory and feed it to
+// the parser in large slices, skipping the connection API. Returns NULL if
+// the file can't be mapped, so that the caller can fall back on connections.
+
+#define RMARK_MMAP_SLICE_SIZE (1 << 22)
+
+typedef struct {
+    int fd;
+    void *addr;
+    size_t length;
+} rmark_mapping;
+
+void rmark_finalize_mapping_ptr(SEXP x) {
+#ifndef _WIN32
+    rmark_mapping *mapping = R_ExternalPtrAddr(x);
+    if (mapping) {
+        if (mapping->addr)
+            munmap(mapping->addr, mapping->length);
+        if (mapping->fd >= 0)
+            close(mapping->fd);
+        free(mapping);
+        R_ClearExternalPtr(x);
+    }
+#endif
+}
+
+// Compressed files are handled transparently by file() connections.
+bool rmark_is_compressed(const unsigned char *data, size_t length) {
+    return (length >= 2 && data[0] == 0x1f && data[1] == 0x8b) || // gzip
+           (length >= 3 && memcmp(data, "BZh", 3) == 0) || // bzip2
+           (length >= 6 && memcmp(data, "\xfd" "7zXZ\0", 6) == 0); // xz
+}
+
+SEXP rmark_read_md_mmap(SEXP x, SEXP arena) {
+#ifdef _WIN32
+    return R_NilValue;
+#else
+    double start = rmark_now();
+    const char *path = R_ExpandFileName(Rf_translateChar(STRING_ELT(x, 0)));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return R_NilValue; // Let the connection report the error.
+    }
+
+    // Make sure the file is unmapped and closed if there's an error parsing.
+    rmark_mapping *mapping = malloc(sizeof(rmark_mapping));
+    if (!mapping) {
+        close(fd);
+        return R_NilValue;
+    }
+    *mapping = (rmark_mapping) { fd, NULL, 0 };
+    SEXP mapping_ptr = PROTECT(R_MakeExternalPtr(mapping, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(mapping_ptr, &rmark_finalize_mapping_ptr);
+
+    // Pipes and other special files can't be mapped.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        rmark_finalize_mapping_ptr(mapping_ptr);
+        UNPROTECT(1);
+        return R_NilValue;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        rmark_finalize_mapping_ptr(mapping_ptr);
+        UNPROTECT(1);
+        return R_NilValue;
+    }
+    mapping->addr = addr;
+    mapping->length = st.st_size;
+#ifdef MADV_SEQUENTIAL
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    if (rmark_is_compressed(addr, mapping->length)) {
+        rmark_finalize_mapping_ptr(mapping_ptr);
+        UNPROTECT(1);
+        return R_NilValue;
+    }
+
+    int options = CMARK_OPT_DEFAULT;
+    bool use_arena = Rf_asLogical(arena) == TRUE;
+    if (rmark_cache_enabled() || use_arena) {
+        cmark_node *root = rmark_parse_cached(addr, mapping->length, options, use_arena);
+        rmark_finalize_mapping_ptr(mapping_ptr);
+        rmark_stats_parsed(start, 1);
+        UNPROTECT(1);
+        return make_r_root(root);
+    }
+
+    cmark_parser *parser = cmark_parser_new_with_mem(options, &rmark_mem);
+    SEXP parser_ptr = PROTECT(R_MakeExternalPtr(parser, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(parser_ptr, &rmark_finalize_parser_ptr);
+
+    const char *data = addr;
+    for (size_t offset = 0; offset < mapping->length; offset += RMARK_MMAP_SLICE_SIZE) {
+        R_CheckUserInterrupt();
+        size_t length = mapping->length - offset;
+        if (length > RMARK_MMAP_SLICE_SIZE)
+            length = RMARK_MMAP_SLICE_SIZE;
+        cmark_parser_feed(parser, data + offset, length);
+    }
+    cmark_node *root = cmark_parser_finish(parser);
+    rmark_finalize_mapping_ptr(mapping_ptr);
+    rmark_stats_parsed(start, 1);
+
+    UNPROTECT(2);
+    return make_r_root(root);
+#endif // _WIN32
+}
+
+// Get the UTF-8 bytes of a string, translating only if it isn't already UTF-8 or ASCII.
+const char *rmark_utf8_chars(SEXP string, size_t *length) {
+    if (Rf_charIsASCII(string) || Rf_charIsUTF8(string)) {
+        *length = LENGTH(string);
+        return CHAR(string);
+    }
+    const char *chars = Rf_translateCharUTF8(string);
+    *length = strlen(chars);
+    return chars;
+}
+
+// Join lines into a single buffer, allocated with R_alloc().
+const char *rmark_join_lines(SEXP x, size_t *length) {
+    R_xlen_t n = XLENGTH(x);
+    const char **lines = (const char **) R_alloc(n, sizeof(const char *));
+    size_t *lengths = (size_t *) R_alloc(n, sizeof(size_t));
+    size_t total = 0;
+    for (R_xlen_t i = 0; i < n; i++) {
+        lines[i] = rmark_utf8_chars(STRING_ELT(x, i), &lengths[i]);
+        total += lengths[i] + (i > 0);
+    }
+    char *input = R_alloc(total + 1, sizeof(char));
+    size_t offset = 0;
+    for (R_xlen_t i = 0; i < n; i++) {
+        if (i > 0)
+            input[offset++] = '\n';
+        memcpy(input + offset, lines[i], lengths[i]);
+        offset += lengths[i];
+    }
+    *length = total;
+    return input;
+}
+
+// The cache and arenas need contiguous input, so lines are joined for them.
+SEXP rmark_parse_md_joined(SEXP x, int options, bool use_arena) {
+    if (TYPEOF(x) == RAWSXP)
+        return make_r_root(rmark_parse_cached((const char *) RAW(x), XLENGTH(x), options, use_arena));
+
+    size_t length = 0;
+    const char *input = rmark_join_lines(x, &length);
+    return make_r_root(rmark_parse_cached(input, length, options, use_arena));
+}
+
+// Lines are fed to the parser one at a time, so that they don't have to be
+// joined in R first. Raw vectors are fed as they are.
+SEXP rmark_parse_md(SEXP x, SEXP arena) {
+    double start = rmark_now();
+    int options = CMARK_OPT_DEFAULT;
+    bool use_arena = Rf_asLogical(arena) == TRUE;
+    if (rmark_cache_enabled() || use_arena) {
+        SEXP result = rmark_parse_md_joined(x, options, use_arena);
+        rmark_stats_parsed(start, 1);
+        return result;
+    }
+
+    cmark_parser *parser = cmark_parser_new_with_mem(options, &rmark_mem);
+
+    // Make sure parser is free'd if there's an error translating input.
+    SEXP ptr = PROTECT(R_MakeExternalPtr(parser, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_parser_ptr);
+
+    if (TYPEOF(x) == RAWSXP) {
+        cmark_parser_feed(parser, (const char *) RAW(x), XLENGTH(x));
+    } else {
+        for (R_xlen_t i = 0; i < XLENGTH(x); i++) {
+            size_t length = 0;
+            const char *line = rmark_utf8_chars(STRING_ELT(x, i), &length);
+            if (i > 0)
+                cmark_parser_feed(parser, "\n", 1);
+            cmark_parser_feed(parser, line, length);
+        }
+    }
+    cmark_node *root = cmark_parser_finish(parser);
+    rmark_stats_parsed(start, 1);
+
+    UNPROTECT(1);
+    return make_r_root(root);
+}
+
+// Incremental parsers keep their state between calls, so that input can be
+// fed as it arrives. Finishing returns the document and starts a new one.
+
+cmark_parser *rmark_parser_get(SEXP x) {
+    if (TYPEOF(x) != EXTPTRSXP || R_ExternalPtrTag(x) != rmark_parser_symbol)
+        Rf_error("`parser` must be a Markdown parser.");
+    cmark_parser *parser = R_ExternalPtrAddr(x);
+    if (!parser)
+        Rf_error("`parser` is no longer valid. Was it saved and reloaded?");
+    return parser;
+}
+
+SEXP rmark_parser_new(void) {
+    int options = CMARK_OPT_DEFAULT;
+    SEXP ptr = PROTECT(R_MakeExternalPtr(NULL, rmark_parser_symbol, R_NilValue));
+    R_RegisterCFinalizer(ptr, &rmark_finalize_parser_ptr);
+    R_SetExternalPtrAddr(ptr, cmark_parser_new_with_mem(options, &rmark_mem));
+    UNPROTECT(1);
+    return ptr;
+}
+
+SEXP rmark_parser_feed(SEXP x, SEXP chunk) {
+    cmark_parser *parser = rmark_parser_get(x);
+    if (TYPEOF(chunk) == RAWSXP) {
+        cmark_parser_feed(parser, (const char *) RAW(chunk), XLENGTH(chunk));
+    } else if (TYPEOF(chunk) == STRSXP) {
+        for (R_xlen_t i = 0; i < XLENGTH(chunk); i++) {
+            if (STRING_ELT(chunk, i) == NA_STRING)
+                Rf_error("`chunk` must not contain missing values.");
+            size_t length = 0;
+            const char *input = rmark_utf8_chars(STRING_ELT(chunk, i), &length);
+            cmark_parser_feed(parser, input, length);
+        }
+    } else {
+        Rf_error("`chunk` must be a character or raw vector, not <%s>.", Rf_type2char(TYPEOF(chunk)));
+    }
+    return R_NilValue;
+}
+
+SEXP rmark_parser_finish(SEXP x) {
+    double start = rmark_now();
+    int options = CMARK_OPT_DEFAULT;
+    cmark_parser *parser = rmark_parser_get(x);
+    cmark_node *root = cmark_parser_finish(parser);
+    rmark_stats_parsed(start, 1);
+
+    // Replace the parser rather than rely on it being reset by finishing.
+    cmark_parser_free(parser);
+    R_SetExternalPtrAddr(x, cmark_parser_new_with_mem(options, &rmark_mem));
+
+    return make_r_root(root);
+}
+
+// Reparsing replaces the top-level blocks around an edit with blocks parsed
+// from the same lines of the new text. The parser state at the start of a
+// top-level block doesn't depend on earlier blocks, so the slice starts one
+// block before the edit, and ends one block after it. The slice grows if its
+// last block could have continued into the next one.
+
+// Count lines the way cmark does: a final line break doesn't start a line.
+int rmark_count_lines(const char *data, size_t length) {
+    int lines = 0;
+    for (const char *p = data, *end = data + length; p < end; lines++) {
+        const char *newline = memchr(p, '\n', end - p);
+        p = (newline) ? newline + 1 : end;
+    }
+    return lines;
+}
+
+// Byte offset of the start of a line, or the length if there aren't as many.
+size_t rmark_line_offset(const char *data, size_t length, int line) {
+    const char *p = data, *end = data + length;
+    for (int i = 1; i < line && p < end; i++) {
+        const char *newline = memchr(p, '\n', end - p);
+        p = (newline) ? newline + 1 : end;
+    }
+    return p - data;
+}
+
+// Link reference definitions affect links anywhere in the document, and a
+// slice parsed on its own can't see the definitions outside it, so
+// documents that might contain one aren't reparsed in slices.
+bool rmark_has_link_definition(const char *data, size_t length) {
+    for (const char *p = data, *end = data + length; p < end;) {
+        const char *newline = memchr(p, '\n', end - p);
+        const char *line_end = (newline) ? newline : end;
+        const char *q = p;
+        while (q < line_end && q - p < 3 && *q == ' ')
+            q++;
+        if (q < line_end && *q == '[') {
+            for (; q + 1 < line_end; q++)
+                if (q[0] == ']' && q[1] == ':')
+                    return true;
+        }
+        p = (newline) ? newline + 1 : end;
+    }
+    return false;
+}
+
+// Could the last block of a reparsed slice continue into the next block?
+bool rmark_reparse_is_open(cmark_node *doc, int lines, cmark_node *next) {
+    cmark_node *last = cmark_node_last_child(doc);
+    if (!last)
+        return false;
+    cmark_node_type type = cmark_node_get_type(last);
+    if (type == CMARK_NODE_LIST && cmark_node_get_type(next) == CMARK_NODE_LIST)
+        return true; // Lists separated by blank lines merge if their markers match.
+    if (type == CMARK_NODE_HEADING || type == CMARK_NODE_THEMATIC_BREAK)
+        return false;
+    return cmark_node_get_end_line(last) >= lines;
+}
+
+// Free a block removed by reparsing, unless R holds wrappers into it. Then it
+// becomes a tree of its own, like an unlinked node.
+void rmark_reparse_release(SEXP root, cmark_node *block) {
+    SEXP registry = R_ExternalPtrProtected(root);
+    if (REGISTRY(registry)->line_shifts)
+        rmark_shift_table_drop(REGISTRY(registry)->line_shifts, block);
+    for (cmark_node *node = block; node; node = rmark_preorder_next(node, block)) {
+        if (rmark_registry_get(registry, node) != R_NilValue) {
+            SEXP r_node = PROTECT(make_r_node(root, block));
+            rmark_node_promote_to_tree(PTR(r_node));
+            UNPROTECT(1);
+            return;
+        }
+        rmark_registry_remove(registry, node); // Stale references to freed nodes.
+    }
+    cmark_node_free(block);
+}
+
+// Reparse lines first..last of the new text, which replaced the lines of the
+// old text between the same unchanged prefix and suffix. Returns the lines
+// of the new text that were parsed.
+SEXP rmark_reparse(SEXP x, SEXP text, SEXP changed) {
+    double start = rmark_now();
+    int options = CMARK_OPT_DEFAULT;
+    SEXP root = ROOT(x);
+    cmark_node *doc = NODE(x);
+
+    size_t length = 0;
+    const char *input = (TYPEOF(text) == RAWSXP) ? (const char *) RAW(text) : rmark_join_lines(text, &length);
+    if (TYPEOF(text) == RAWSXP)
+        length = XLENGTH(text);
+
+    int new_count = rmark_count_lines(input, length);
+    int old_count = rmark_node_position(doc).end_line + rmark_line_shift(root, doc);
+    int delta = new_count - old_count;
+    int first = INTEGER(changed)[0];
+    int old_last = INTEGER(changed)[1] - delta;
+
+    int k = 0;
+    for (cmark_node *child = cmark_node_first_child(doc); child; child = cmark_node_next(child))
+        k++;
+    cmark_node **blocks = (cmark_node **) R_alloc(k + 1, sizeof(cmark_node *));
+    int *starts = (int *) R_alloc(k + 1, sizeof(int));
+    int *ends = (int *) R_alloc(k + 1, sizeof(int));
+    bool full = false; // Reparse everything if positions are missing.
+    k = 0;
+    for (cmark_node *child = cmark_node_first_child(doc); child; child = cmark_node_next(child), k++) {
+        rmark_position position = rmark_tree_position(root, child);
+        blocks[k] = child;
+        starts[k] = position.start_line;
+        ends[k] = position.end_line;
+        full = full || position.start_line == 0;
+    }
+    if (!full && old_last < first - 1)
+        Rf_error("`changed_lines` must include all lines added to `new_text`.");
+    full = full || rmark_has_link_definition(input, length);
+
+    // Blocks touching the edit, and one more on each side.
+    int i0 = 0, i1 = k - 1;
+    while (i0 < k && ends[i0] < first - 1)
+        i0++;
+    while (i1 >= 0 && starts[i1] > old_last + 1)
+        i1--;
+    i0 = (i0 > 0) ? i0 - 1 : 0;
+    i1 = (i1 + 1 < k) ? i1 + 1 : k - 1;
+
+    cmark_node *parsed = NULL;
+    int slice_start = 1, slice_end = new_count;
+    for (int grow = 1;; grow *= 2) {
+        if (full) {
+            i0 = 0;
+            i1 = k - 1;
+        }
+        slice_start = (i0 == 0) ? 1 : ends[i0 - 1] + 1;
+        slice_end = ((i1 == k - 1) ? old_count : starts[i1 + 1] - 1) + delta;
+        size_t from = rmark_line_offset(input, length, slice_start);
+        size_t to = rmark_line_offset(input, length, slice_end + 1);
+        to = (to > from) ? to : from;
+        parsed = rmark_parse_document(input + from, to - from, options);
+        if (i1 == k - 1 || !rmark_reparse_is_open(parsed, slice_end - slice_start + 1, blocks[i1 + 1]))
+            break;
+        cmark_node_free(parsed);
+        i1 = (i1 + grow < k - 1) ? i1 + grow : k - 1;
+    }
+
+    // Splice the new blocks in place of the old ones, and move later blocks.
+    cmark_node *next = (i1 + 1 < k) ? blocks[i1 + 1] : NULL;
+    for (int i = i0; i <= i1; i++) {
+        rmark_tree_touch(root, blocks[i]);
+        cmark_node_unlink(blocks[i]);
+        rmark_reparse_release(root, blocks[i]);
+    }
+    cmark_node *child;
+    while ((child = cmark_node_first_child(parsed))) {
+        rmark_set_line_shift(root, child, slice_start - 1);
+        if (next)
+            cmark_node_insert_before(next, child);
+        else
+            cmark_node_append_child(doc, child);
+    }
+    cmark_node_free(parsed);
+    rmark_tree_touch(root, doc);
+    for (int i = i1 + 1; i < k; i++)
+        rmark_set_line_shift(root, blocks[i], rmark_line_shift(root, blocks[i]) + delta);
+    rmark_set_line_shift(root, doc, new_count - rmark_node_position(doc).end_line);
+    rmark_stats_parsed(start, 1);
+
+    SEXP result = PROTECT(Rf_allocVector(INTSXP, 2));
+    INTEGER(result)[0] = slice_start;
+    INTEGER(result)[1] = slice_end;
+    UNPROTECT(1);
+    return result;
+}
+
+// Documents in a batch are parsed on worker threads. Inputs are extracted
+// from R objects beforehand, and R nodes are created afterwards, so workers
+// only ever touch cmark and C library functions.
+
+typedef struct {
+    const char *input; // Document text, or NULL to read from path.
+    size_t length;
+    const char *path;
+    cmark_node *root;
+    int errnum; // errno if reading failed.
+    bool compressed; // Left for a connection to read on the main thread.
+} rmark_batch_doc;
+
+#define RMARK_BATCH_BUFSIZE 65536
+
+void rmark_batch_parse_doc(rmark_batch_doc *doc, int options, bool use_arena) {
+    if (doc->input) {
+        doc->root = rmark_parse_document_arena(doc->input, doc->length, options, use_arena);
+        return;
+    }
+
+    FILE *file = fopen(doc->path, "rb");
+    if (!file) {
+        doc->errnum = errno;
+        return;
+    }
+    rmark_arena *arena = (use_arena) ? rmark_arena_new() : NULL;
+    rmark_current_arena = arena;
+    cmark_parser *parser = cmark_parser_new_with_mem(options, &rmark_mem);
+    char *buf = malloc(RMARK_BATCH_BUFSIZE);
+    size_t bytes_read = 0;
+    bool first = true;
+    while (buf && (bytes_read = fread(buf, 1, RMARK_BATCH_BUFSIZE, file))) {
+        if (first && rmark_is_compressed((unsigned char *) buf, bytes_read)) {
+            doc->compressed = true;
+            break;
+        }
+        first = false;
+        cmark_parser_feed(parser, buf, bytes_read);
+    }
+    if (!buf || ferror(file)) {
+        doc->errnum = (buf) ? EIO : ENOMEM;
+    } else if (!doc->compressed) {
+        doc->root = cmark_parser_finish(parser);
+    }
+    free(buf);
+    cmark_parser_free(parser);
+    if (arena)
+        rmark_arena_seal(arena);
+    fclose(file);
+}
+
+int rmark_threads_arg(SEXP threads) {
+    int n_threads = Rf_asInteger(threads);
+    if (n_threads == NA_INTEGER || n_threads < 1)
+        Rf_error("`threads` must be a positive integer.");
+    return n_threads;
+}
+
+SEXP rmark_parse_batch(SEXP x, SEXP is_files, SEXP threads, SEXP arena) {
+    double start = rmark_now();
+    int options = CMARK_OPT_DEFAULT;
+    int n_threads = rmark_threads_arg(threads);
+    bool use_arena = Rf_asLogical(arena) == TRUE;
+    bool files = LOGICAL(is_files)[0];
+    R_xlen_t n = Rf_xlength(x);
+
+    rmark_batch_doc *docs = (rmark_batch_doc *) R_alloc(n, sizeof(rmark_batch_doc));
+    for (R_xlen_t i = 0; i < n; i++) {
+        SEXP string = STRING_ELT(x, i);
+        if (string == NA_STRING)
+            Rf_error("`x` must not contain missing values.");
+        docs[i] = (rmark_batch_doc) {0};
+        if (files) {
+            // R_ExpandFileName() returns a static buffer, so keep a copy.
+            const char *path = R_ExpandFileName(Rf_translateChar(string));
+            char *copy = R_alloc(strlen(path) + 1, sizeof(char));
+            strcpy(copy, path);
+            docs[i].path = copy;
+        } else {
+            docs[i].input = rmark_utf8_chars(string, &docs[i].length);
+        }
+    }
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+#else
+    (void) n_threads; // Documents are parsed serially without OpenMP.
+#endif
+    for (R_xlen_t i = 0; i < n; i++)
+        rmark_batch_parse_doc(&docs[i], options, use_arena);
+
+    for (R_xlen_t i = 0; i < n; i++) {
+        if (docs[i].errnum) {
+            int errnum = docs[i].errnum;
+            for (R_xlen_t j = 0; j < n; j++) {
+                if (docs[j].root)
+                    cmark_node_free(docs[j].root);
+            }
+            Rf_error("Failed to read '%s': %s.", docs[i].path, strerror(errnum));
+        }
+    }
+    rmark_stats_parsed(start, n);
+
+    // Compressed files are returned as NULL for read_md_batch() to read.
+    SEXP result = PROTECT(Rf_allocVector(VECSXP, n));
+    for (R_xlen_t i = 0; i < n; i++) {
+        if (docs[i].root)
+            SET_VECTOR_ELT(result, i, make_r_root(docs[i].root));
+    }
+    UNPROTECT(1);
+    return result;
+}
+
+/** Rendering */
+
+// TODO: Allow customizing rendering options from R.
+
+typedef enum {
+    RMARK_OUTPUT_NONE,
+    RMARK_OUTPUT_COMMONMARK,
+    RMARK_OUTPUT_HTML,
+    RMARK_OUTPUT_LATEX,
+    RMARK_OUTPUT_MAN,
+    RMARK_OUTPUT_XML,
+} rmark_output_format;
+
+// Render a tree without touching R, so it's safe to call from worker threads.
+// Returns NULL if rendering fails; the caller must free the output with
+// rmark_mem_free(), since it comes from the counting allocator of the tree.
+char *rmark_render_node(cmark_node *root, rmark_output_format format, int options, int width) {
+    switch (format) {
+        case RMARK_OUTPUT_COMMONMARK: return cmark_render_commonmark(root, options, width);
+        case RMARK_OUTPUT_HTML:       return cmark_render_html(root, options);
+        case RMARK_OUTPUT_LATEX:      return cmark_render_latex(root, options, width);
+        case RMARK_OUTPUT_MAN:        return cmark_render_man(root, options, width);
+        case RMARK_OUTPUT_XML:        return cmark_render_xml(root, options);
+        default:                      return NULL;
+    }
+}
+
+rmark_output_format rmark_output_format_arg(SEXP output_format) {
+    rmark_output_format format = INTEGER(output_format)[0];
+    if (format <= RMARK_OUTPUT_NONE || format > RMARK_OUTPUT_XML)
+        Rf_error("Unknown output format: %d.", format);
+    return format;
+}
+
+// Render a document from the render cache of its tree, rendering blocks that
+// changed since they were cached. HTML is rendered block by block, like for
+// connections; other formats are cached for the whole document.
+SEXP rmark_render_cached(SEXP x, rmark_output_format format, int options, int width) {
+    cmark_node *root = NODE(x);
+    rmark_registry *registry = REGISTRY(R_ExternalPtrProtected(ROOT(x)));
+    if (!registry->render_cache)
+        registry->render_cache = rmark_render_cache_new();
+    rmark_render_cache *cache = registry->render_cache;
+    if (format == RMARK_OUTPUT_HTML || format == RMARK_OUTPUT_XML)
+        width = 0; // Doesn't affect the output.
+
+    bool by_block = format == RMARK_OUTPUT_HTML;
+    int n = 1;
+    if (by_block) {
+        n = 0;
+        for (cmark_node *block = cmark_node_first_child(root); block; block = cmark_node_next(block))
+            n++;
+    }
+    rmark_render_entry **entries = (rmark_render_entry **) R_alloc(n, sizeof(rmark_render_entry *));
+    int count = 0, hits = 0, rerenders = 0;
+    size_t length = 0;
+    cmark_node *first = (by_block) ? cmark_node_first_child(root) : root;
+    for (cmark_node *block = first; block; block = (by_block) ? cmark_node_next(block) : NULL) {
+        rmark_render_entry *entry = rmark_render_cache_find(cache, block, format, width);
+        if (entry) {
+            hits++;
+        } else {
+            char *output = rmark_render_node(block, format, options, width);
+            if (!output)
+                Rf_error("Failed to render document.");
+            entry = rmark_render_cache_store(cache, block, format, width, output);
+            rerenders++;
+        }
+        entries[count++] = entry;
+        length += entry->length;
+    }
+    registry->render_hits += hits;
+    registry->render_rerenders += rerenders;
+
+    if (length > R_LEN_T_MAX)
+        Rf_error("Rendered document is too large for an R string.");
+    char *output = R_alloc(length + 1, sizeof(char));
+    size_t offset = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(output + offset, entries[i]->output, entries[i]->length);
+        offset += entries[i]->length;
+    }
+    SEXP result = PROTECT(Rf_ScalarString(Rf_mkCharLenCE(output, (int) length, CE_UTF8)));
+    const char *names[] = { "hits", "rerendered", "" };
+    SEXP counts = PROTECT(Rf_mkNamed(INTSXP, names));
+    INTEGER(counts)[0] = hits;
+    INTEGER(counts)[1] = rerenders;
+    Rf_setAttrib(result, Rf_install("cache"), counts);
+    UNPROTECT(2);
+    return result;
+}
+
+SEXP rmark_render(SEXP x, SEXP output_format, SEXP output_width, SEXP cache) {
+    double start = rmark_now();
+    cmark_node *root = NODE(x);
+    int options = CMARK_OPT_DEFAULT;
+    int width = INTEGER(output_width)[0];
+    rmark_output_format format = rmark_output_format_arg(output_format);
+
+    if (Rf_asLogical(cache) == TRUE && cmark_node_get_type(root) == CMARK_NODE_DOCUMENT) {
+        SEXP result = rmark_render_cached(x, format, options, width);
+        rmark_stats_rendered(start, 1);
+        return result;
+    }
+
+    char *output = rmark_render_node(root, format, options, width);
+    if (!output) {
+        Rf_error("Failed to render document.");
+    }
+
+    SEXP result = PROTECT(Rf_mkStringUTF8(output));
+    rmark_mem_free(output);
+    rmark_stats_rendered(start, 1);
+    UNPROTECT(1);
+    return result;
+}
+
+SEXP rmark_render_batch(SEXP x, SEXP output_format, SEXP output_width, SEXP threads) {
+    double start = rmark_now();
+    int options = CMARK_OPT_DEFAULT;
+    int width = INTEGER(output_width)[0];
+    rmark_output_format format = rmark_output_format_arg(output_format);
+    int n_threads = rmark_threads_arg(threads);
+
+    R_xlen_t n = 0;
+    cmark_node **roots = rmark_resolve_nodes(x, R_NilValue, &n);
+    char **outputs = (char **) R_alloc(n, sizeof(char *));
+
+    // No R code runs until the loop is done, so the trees can't be mutated.
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+#else
+    (void) n_threads; // Documents are rendered serially without OpenMP.
+#endif
+    for (R_xlen_t i = 0; i < n; i++)
+        outputs[i] = rmark_render_node(roots[i], format, options, width);
+
+    for (R_xlen_t i = 0; i < n; i++) {
+        if (!outputs[i]) {
+            for (R_xlen_t j = 0; j < n; j++)
+                rmark_mem_free(outputs[j]);
+            Rf_error("Failed to render document %lld.", (long long) i + 1);
+        }
+    }
+
+    // Free outputs as we go; mkChar can only fail on allocation errors.
+    SEXP result = PROTECT(Rf_allocVector(STRSXP, n));
+    for (R_xlen_t i = 0; i < n; i++) {
+        SET_STRING_ELT(result, i, Rf_mkCharCE(outputs[i], CE_UTF8));
+        rmark_mem_free(outputs[i]);
+    }
+    rmark_stats_rendered(start, n);
+    UNPROTECT(1);
+    return result;
+}
+
+void rmark_finalize_output_ptr(SEXP x) {
+    rmark_mem_free(R_ExternalPtrAddr(x));
+    R_ClearExternalPtr(x);
+}
+
+// Render straight to a connection without making an R string. HTML output of
+// a document is the concatenation of the output of its blocks, so we render
+// it one top-level block at a time to bound peak memory by the largest block.
+// Other formats depend on the context of sibling blocks, so render them whole.
+SEXP rmark_render_connection(SEXP x, SEXP output_format, SEXP output_width, SEXP connection) {
+#if R_CONNECTIONS_VERSION > 1
+    Rf_error("rmark was built with an unsupported version of the R connections API.");
+#else
+    double start = rmark_now();
+    cmark_node *root = NODE(x);
+    int options = CMARK_OPT_DEFAULT;
+    int width = INTEGER(output_width)[0];
+    rmark_output_format format = rmark_output_format_arg(output_format);
+    Rconnection conn = R_GetConnection(connection);
+
+    bool per_block = format == RMARK_OUTPUT_HTML && cmark_node_get_type(root) == CMARK_NODE_DOCUMENT;
+    cmark_node *node = (per_block) ? cmark_node_first_child(root) : root;
+    for (; node; node = (per_block) ? cmark_node_next(node) : NULL) {
+        R_CheckUserInterrupt();
+        char *output = rmark_render_node(node, format, options, width);
+        if (!output) {
+            Rf_error("Failed to render document.");
+        }
+
+        // Make sure output is free'd if there's an error writing to the connection.
+        SEXP ptr = PROTECT(R_MakeExternalPtr(output, R_NilValue, R_NilValue));
+        R_RegisterCFinalizer(ptr, &rmark_finalize_output_ptr);
+
+        size_t length = strlen(output);
+        if (R_WriteConnection(conn, output, length) != length) {
+            Rf_error("Failed to write rendered output to the connection.");
+        }
+
+        rmark_finalize_output_ptr(ptr);
+        UNPROTECT(1);
+    }
+    rmark_stats_rendered(start, 1);
+
+    return R_NilValue;
+#endif // R_CONNECTIONS_VERSION
+}
+
+/** Statistics */
+
+// Walk the tree of x to count its nodes and the bytes cmark holds for them.
+// Strings are counted by length, since cmark may not own them separately.
+SEXP rmark_tree_stats(SEXP x) {
+    SEXP root = ROOT(x);
+    SEXP registry = R_ExternalPtrProtected(root);
+    rmark_registry *reg = REGISTRY(registry);
+
+    double nodes = 0, bytes = 0;
+    cmark_node *top = R_ExternalPtrAddr(root);
+    for (cmark_node *node = top; node; node = rmark_preorder_next(node, top)) {
+        nodes++;
+        bytes += rmark_alloc_size(node);
+        const char *strings[] = {
+            cmark_node_get_literal(node), cmark_node_get_url(node), cmark_node_get_title(node),
+            cmark_node_get_fence_info(node), cmark_node_get_on_enter(node), cmark_node_get_on_exit(node),
+        };
+        for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++)
+            if (strings[i] && strings[i][0])
+                bytes += strlen(strings[i]) + 1;
+    }
+
+    int live = 0;
+    for (int i = 0; i < reg->capacity; i++) {
+        if (reg->keys[i] && rmark_registry_ref_is_live(VECTOR_ELT(REGISTRY_REFS(registry), i)))
+            live++;
+    }
+
+    const char *names[] = {
+        "nodes", "live_wrappers", "registry_entries", "registry_capacity", "pruned_refs",
+        "adoptions", "adoption_scans", "adoption_visited", "cmark_bytes_estimate",
+        "render_cache_entries", "render_cache_bytes", "render_cache_hits", "render_cache_rerenders", ""
+    };
+    SEXP out = PROTECT(Rf_mkNamed(VECSXP, names));
+    SET_VECTOR_ELT(out, 0, Rf_ScalarReal(nodes));
+    SET_VECTOR_ELT(out, 1, Rf_ScalarReal(live));
+    SET_VECTOR_ELT(out, 2, Rf_ScalarReal(reg->count));
+    SET_VECTOR_ELT(out, 3, Rf_ScalarReal(reg->capacity));
+    SET_VECTOR_ELT(out, 4, Rf_ScalarReal(reg->pruned));
+    SET_VECTOR_ELT(out, 5, Rf_ScalarReal(reg->adoptions));
+    SET_VECTOR_ELT(out, 6, Rf_ScalarReal(reg->adoption_scans));
+    SET_VECTOR_ELT(out, 7, Rf_ScalarReal(reg->adoption_visited));
+    SET_VECTOR_ELT(out, 8, Rf_ScalarReal(bytes));
+    SET_VECTOR_ELT(out, 9, Rf_ScalarReal((reg->render_cache) ? reg->render_cache->count : 0));
+    SET_VECTOR_ELT(out, 10, Rf_ScalarReal((reg->render_cache) ? reg->render_cache->bytes : 0));
+    SET_VECTOR_ELT(out, 11, Rf_ScalarReal(reg->render_hits));
+    SET_VECTOR_ELT(out, 12, Rf_ScalarReal(reg->render_rerenders));
+    UNPROTECT(1);
+    return out;
+}
+
+SEXP rmark_process_stats_get(SEXP reset) {
+    rmark_stats *stats = &rmark_process_stats;
+    const char *names[] = {
+        "parse_calls", "parse_seconds", "render_calls", "render_seconds",
+        "cmark_allocations", "cmark_bytes", "cmark_peak_bytes", ""
+    };
+    SEXP out = PROTECT(Rf_mkNamed(VECSXP, names));
+    SET_VECTOR_ELT(out, 0, Rf_ScalarReal(stats->parse_calls));
+    SET_VECTOR_ELT(out, 1, Rf_ScalarReal(stats->parse_seconds));
+    SET_VECTOR_ELT(out, 2, Rf_ScalarReal(stats->render_calls));
+    SET_VECTOR_ELT(out, 3, Rf_ScalarReal(stats->render_seconds));
+    SET_VECTOR_ELT(out, 4, Rf_ScalarReal(stats->cmark_allocations));
+    SET_VECTOR_ELT(out, 5, Rf_ScalarReal((double) stats->cmark_bytes));
+    SET_VECTOR_ELT(out, 6, Rf_ScalarReal((double) stats->cmark_peak_bytes));
+
+    // Live bytes are a gauge, so only the counters and the peak are reset.
+    if (Rf_asLogical(reset) == TRUE) {
+        stats->parse_calls = stats->parse_seconds = 0;
+        stats->render_calls = stats->render_seconds = 0;
+        stats->cmark_allocations = 0;
+        stats->cmark_peak_bytes = stats->cmark_bytes;
+    }
+    UNPROTECT(1);
+    return out;
+}
+
 /** Version Info */
 
 SEXP rmark_cmark_version_string() {
@@ -572,19 +4589,34 @@ SEXP rmark_cmark_version_string() {
 
 R_CallMethodDef call_method_defs[] = {
     { "rmark_cmark_version_string",   (DL_FUNC) &rmark_cmark_version_string,   0 },
-    { "rmark_read_md",                (DL_FUNC) &rmark_read_md,                1 },
-    { "rmark_parse_md",               (DL_FUNC) &rmark_parse_md,               1 },
-    { "rmark_render",                 (DL_FUNC) &rmark_render,                 3 },
+    { "rmark_read_md",                (DL_FUNC) &rmark_read_md,                2 },
+    { "rmark_read_md_mmap",           (DL_FUNC) &rmark_read_md_mmap,           2 },
+    { "rmark_parse_md",               (DL_FUNC) &rmark_parse_md,               2 },
+    { "rmark_cache_set_limit",        (DL_FUNC) &rmark_cache_set_limit,        1 },
+    { "rmark_cache_clear",            (DL_FUNC) &rmark_cache_clear,            0 },
+    { "rmark_cache_info",             (DL_FUNC) &rmark_cache_info,             0 },
+    { "rmark_parser_new",             (DL_FUNC) &rmark_parser_new,             0 },
+    { "rmark_parser_feed",            (DL_FUNC) &rmark_parser_feed,            2 },
+    { "rmark_parser_finish",          (DL_FUNC) &rmark_parser_finish,          1 },
+    { "rmark_reparse",                (DL_FUNC) &rmark_reparse,                3 },
+    { "rmark_parse_batch",            (DL_FUNC) &rmark_parse_batch,            4 },
+    { "rmark_render",                 (DL_FUNC) &rmark_render,                 4 },
+    { "rmark_render_batch",           (DL_FUNC) &rmark_render_batch,           4 },
+    { "rmark_render_connection",      (DL_FUNC) &rmark_render_connection,      4 },
     { "rmark_node_is_block",          (DL_FUNC) &rmark_node_is_block,          1 },
     { "rmark_node_is_inline",         (DL_FUNC) &rmark_node_is_inline,         1 },
     { "rmark_node_is_leaf",           (DL_FUNC) &rmark_node_is_leaf,           1 },
     { "rmark_node_new",               (DL_FUNC) &rmark_node_new,               1 },
+    { "rmark_node_clone",             (DL_FUNC) &rmark_node_clone,             1 },
     { "rmark_node_next",              (DL_FUNC) &rmark_node_next,              1 },
     { "rmark_node_previous",          (DL_FUNC) &rmark_node_previous,          1 },
     { "rmark_node_parent",            (DL_FUNC) &rmark_node_parent,            1 },
     { "rmark_node_first_child",       (DL_FUNC) &rmark_node_first_child,       1 },
     { "rmark_node_last_child",        (DL_FUNC) &rmark_node_last_child,        1 },
-    { "rmark_iterate",                (DL_FUNC) &rmark_iterate,                3 },
+    { "rmark_iter_new",               (DL_FUNC) &rmark_iter_new,               3 },
+    { "rmark_iter_next_n",            (DL_FUNC) &rmark_iter_next_n,            3 },
+    { "rmark_iter_reset",             (DL_FUNC) &rmark_iter_reset,             3 },
+    { "rmark_iterate",                (DL_FUNC) &rmark_iterate,                5 },
     { "rmark_node_get_type_string",   (DL_FUNC) &rmark_node_get_type_string,   1 },
     { "rmark_node_get_literal",       (DL_FUNC) &rmark_node_get_literal,       1 },
     { "rmark_node_set_literal",       (DL_FUNC) &rmark_node_set_literal,       2 },
@@ -608,6 +4640,23 @@ R_CallMethodDef call_method_defs[] = {
     { "rmark_node_get_start_column",  (DL_FUNC) &rmark_node_get_start_column,  1 },
     { "rmark_node_get_end_line",      (DL_FUNC) &rmark_node_get_end_line,      1 },
     { "rmark_node_get_end_column",    (DL_FUNC) &rmark_node_get_end_column,    1 },
+    { "rmark_flatten",                (DL_FUNC) &rmark_flatten,                2 },
+    { "rmark_plain_text",             (DL_FUNC) &rmark_plain_text,             1 },
+    { "rmark_outline",                (DL_FUNC) &rmark_outline,                1 },
+    { "rmark_links",                  (DL_FUNC) &rmark_links,                  1 },
+    { "rmark_build",                  (DL_FUNC) &rmark_build,                  1 },
+    { "rmark_nodes_get",              (DL_FUNC) &rmark_nodes_get,              3 },
+    { "rmark_nodes_set",              (DL_FUNC) &rmark_nodes_set,              4 },
+    { "rmark_selector_compile",       (DL_FUNC) &rmark_selector_compile,       1 },
+    { "rmark_select",                 (DL_FUNC) &rmark_select,                 3 },
+    { "rmark_node_consolidate",       (DL_FUNC) &rmark_node_consolidate,       1 },
+    { "rmark_serialize",              (DL_FUNC) &rmark_serialize,              1 },
+    { "rmark_unserialize",            (DL_FUNC) &rmark_unserialize,            1 },
+    { "rmark_serial_session_new",     (DL_FUNC) &rmark_serial_session_new,     0 },
+    { "rmark_serialize_hook",         (DL_FUNC) &rmark_serialize_hook,         2 },
+    { "rmark_unserialize_hook",       (DL_FUNC) &rmark_unserialize_hook,       2 },
+    { "rmark_tree_stats",             (DL_FUNC) &rmark_tree_stats,             1 },
+    { "rmark_process_stats_get",      (DL_FUNC) &rmark_process_stats_get,      1 },
     { "rmark_node_unlink",            (DL_FUNC) &rmark_node_unlink,            1 },
     { "rmark_node_insert_before",     (DL_FUNC) &rmark_node_insert_before,     2 },
     { "rmark_node_insert_after",      (DL_FUNC) &rmark_node_insert_after,      2 },
@@ -619,5 +4668,9 @@ R_CallMethodDef call_method_defs[] = {
 attribute_visible void R_init_rmark(DllInfo *dll_info) {
     rmark_root_symbol = Rf_install("rmark_root");
     rmark_node_symbol = Rf_install("rmark_node");
+    rmark_registry_symbol = Rf_install("rmark_registry");
+    rmark_parser_symbol = Rf_install("rmark_parser");
+    rmark_iter_symbol = Rf_install("rmark_iter");
+    rmark_session_symbol = Rf_install("rmark_session");
     R_registerRoutines(dll_info, NULL, call_method_defs, NULL, NULL);
 }